@@ -0,0 +1,149 @@
+#include "clipping.h"
+
+#include "constants.h"
+
+namespace sor
+{
+	namespace
+	{
+		constexpr u32 FRUSTUM_PLANES_MASK = BIT_FLAG((u8) EClipPlane::Z_NEAR) | BIT_FLAG((u8) EClipPlane::Z_FAR)
+			| BIT_FLAG((u8) EClipPlane::LEFT) | BIT_FLAG((u8) EClipPlane::RIGHT)
+			| BIT_FLAG((u8) EClipPlane::BOTTOM) | BIT_FLAG((u8) EClipPlane::TOP);
+
+		constexpr u32 CLIPPING_PLANES_MASK = BIT_FLAG((u8) EClipPlane::Z_NEAR)
+			| BIT_FLAG((u8) EClipPlane::GUARD_BAND_LEFT) | BIT_FLAG((u8) EClipPlane::GUARD_BAND_RIGHT)
+			| BIT_FLAG((u8) EClipPlane::GUARD_BAND_BOTTOM) | BIT_FLAG((u8) EClipPlane::GUARD_BAND_TOP);
+
+		// Signed distance of the vertex from the plane, positive on the inner side. The screen is spanned by
+		// <0, screenSize> after the perspective division so the side planes are x = 0 and x = width * w etc.
+		float GetPlaneDistance(EClipPlane plane, const Vec4f& v, const Vec2f& screenSize)
+		{
+			switch (plane)
+			{
+			case EClipPlane::Z_NEAR:				return v.w() - NEAR_PLANE;
+			case EClipPlane::Z_FAR:					return FAR_PLANE - v.w();
+			case EClipPlane::LEFT:					return v.x();
+			case EClipPlane::RIGHT:					return screenSize.x * v.w() - v.x();
+			case EClipPlane::BOTTOM:				return v.y();
+			case EClipPlane::TOP:					return screenSize.y * v.w() - v.y();
+			case EClipPlane::GUARD_BAND_LEFT:		return v.x() + RASTER_GUARD_BAND * v.w();
+			case EClipPlane::GUARD_BAND_RIGHT:		return (screenSize.x + RASTER_GUARD_BAND) * v.w() - v.x();
+			case EClipPlane::GUARD_BAND_BOTTOM:		return v.y() + RASTER_GUARD_BAND * v.w();
+			case EClipPlane::GUARD_BAND_TOP:		return (screenSize.y + RASTER_GUARD_BAND) * v.w() - v.y();
+			default:
+				assert(false);
+				return 0.f;
+			}
+		}
+
+		u32 GetOutsidePlanesMask(const Vec4f& v, const Vec2f& screenSize)
+		{
+			u32 mask = 0;
+			for (u8 plane = 0; plane < (u8) EClipPlane::COUNT; plane++)
+			{
+				if (GetPlaneDistance((EClipPlane) plane, v, screenSize) < 0.f)
+					mask |= BIT_FLAG(plane);
+			}
+
+			return mask;
+		}
+
+		// Sutherland-Hodgman, keeps the part of the polygon on the inner side of the plane
+		void ClipPolygon(EClipPlane plane, const Vec2f& screenSize, ClippedPolygon& polygon)
+		{
+			ClippedPolygon clipped;
+			const auto addVertex = [&clipped](const Vec4f& position, const Vec3f& weights)
+			{
+				assert(clipped.vertexCount < ClippedPolygon::MAX_VERTEX_COUNT);
+				clipped.positions[clipped.vertexCount] = position;
+				clipped.weights[clipped.vertexCount] = weights;
+				clipped.vertexCount++;
+			};
+
+			for (int i = 0; i < polygon.vertexCount; i++)
+			{
+				const int next = (i + 1) % polygon.vertexCount;
+				const float distance = GetPlaneDistance(plane, polygon.positions[i], screenSize);
+				const float nextDistance = GetPlaneDistance(plane, polygon.positions[next], screenSize);
+
+				if (distance >= 0.f)
+					addVertex(polygon.positions[i], polygon.weights[i]);
+
+				if ((distance >= 0.f) != (nextDistance >= 0.f))
+				{
+					// always interpolated from the inner vertex so the neighbouring triangle, which has the same edge going
+					// the other way, gets exactly the same intersection
+					const int inner = distance >= 0.f ? i : next;
+					const int outer = distance >= 0.f ? next : i;
+					const float innerDistance = distance >= 0.f ? distance : nextDistance;
+					const float outerDistance = distance >= 0.f ? nextDistance : distance;
+					const float t = innerDistance / (innerDistance - outerDistance);
+
+					addVertex(polygon.positions[inner] * (1.f - t) + polygon.positions[outer] * t,
+						polygon.weights[inner] * (1.f - t) + polygon.weights[outer] * t);
+				}
+			}
+
+			polygon = clipped;
+		}
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	Triangle ClippedPolygon::GetTriangle(int triangleIdx, int originalTriangleIndex) const
+	{
+		assert(triangleIdx < GetTriangleCount());
+
+		return { positions[0], positions[triangleIdx + 1], positions[triangleIdx + 2], originalTriangleIndex };
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	IShaderBase::TriangleVaryingData ClippedPolygon::GetVaryingData(int triangleIdx,
+		const IShaderBase::TriangleVaryingData& originalData) const
+	{
+		assert(triangleIdx < GetTriangleCount());
+
+		return {
+			IShaderBase::BlendVaryingData(originalData, weights[0]),
+			IShaderBase::BlendVaryingData(originalData, weights[triangleIdx + 1]),
+			IShaderBase::BlendVaryingData(originalData, weights[triangleIdx + 2]) };
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	EClipResult ClipTriangle(const Triangle& t, const Vec2i& outputSize, ClippedPolygon& polygon)
+	{
+		const Vec2f screenSize{ static_cast<float>(outputSize.x), static_cast<float>(outputSize.y) };
+
+		const u32 outsideMask0 = GetOutsidePlanesMask(t.v0ss, screenSize);
+		const u32 outsideMask1 = GetOutsidePlanesMask(t.v1ss, screenSize);
+		const u32 outsideMask2 = GetOutsidePlanesMask(t.v2ss, screenSize);
+
+		// all vertices on the outer side of the same frustum plane
+		if ((outsideMask0 & outsideMask1 & outsideMask2 & FRUSTUM_PLANES_MASK) != 0)
+			return EClipResult::CULLED;
+
+		if (((outsideMask0 | outsideMask1 | outsideMask2) & CLIPPING_PLANES_MASK) == 0)
+			return EClipResult::UNCLIPPED;
+
+		polygon.positions[0] = t.v0ss;
+		polygon.positions[1] = t.v1ss;
+		polygon.positions[2] = t.v2ss;
+		polygon.weights[0] = { 1.f, 0.f, 0.f };
+		polygon.weights[1] = { 0.f, 1.f, 0.f };
+		polygon.weights[2] = { 0.f, 0.f, 1.f };
+		polygon.vertexCount = 3;
+
+		// near plane goes first, vertices behind the camera don't say anything about the guard band, the ones
+		// made on the near plane have to be checked against it regardless of what the original ones were
+		for (u8 plane = 0; plane < (u8) EClipPlane::COUNT; plane++)
+		{
+			if ((CLIPPING_PLANES_MASK & BIT_FLAG(plane)) == 0)
+				continue;
+
+			ClipPolygon((EClipPlane) plane, screenSize, polygon);
+			if (polygon.vertexCount < 3)
+				return EClipResult::CULLED;
+		}
+
+		return EClipResult::CLIPPED;
+	}
+}
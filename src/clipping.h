@@ -0,0 +1,64 @@
+#pragma once
+
+#include "core.h"
+#include "shader.h"
+#include "triangle_drawing.h"
+
+namespace sor
+{
+	// How far outside of the screen (in pixels) the rasterizer can take vertices. Triangles that stay within it are only
+	// scissored by the rasterizer, only the ones reaching further are clipped against it.
+	constexpr float RASTER_GUARD_BAND = 8192.f;
+	static_assert(RASTER_GUARD_BAND * 2 < MAX_RASTER_COORDINATE, "guard band has to fit in the integer triangle setup");
+
+	enum class EClipPlane : u8
+	{
+		// view frustum, NEAR and FAR are taken by windows.h macros
+		Z_NEAR,
+		Z_FAR,
+		LEFT,
+		RIGHT,
+		BOTTOM,
+		TOP,
+
+		// planes RASTER_GUARD_BAND pixels away from the sides of the screen
+		GUARD_BAND_LEFT,
+		GUARD_BAND_RIGHT,
+		GUARD_BAND_BOTTOM,
+		GUARD_BAND_TOP,
+
+		COUNT
+	};
+
+	//--------------------------------------------------------------------------------------------------
+	// What's left of a triangle after clipping, a convex polygon that gets drawn as a triangle fan.
+	struct ClippedPolygon
+	{
+		// triangles are clipped against the near plane and the four guard band planes, each can add at most one vertex
+		static constexpr int MAX_VERTEX_COUNT = 3 + 5;
+
+		std::array<Vec4f, MAX_VERTEX_COUNT> positions;		// screen space before perspective division, same as in Triangle
+		std::array<Vec3f, MAX_VERTEX_COUNT> weights;		// barycentric weights of the vertices of the original triangle
+		int vertexCount = 0;
+
+		int GetTriangleCount() const { return std::max(vertexCount - 2, 0); }
+
+		// triangle of the fan, keeps the index of the original triangle
+		Triangle GetTriangle(int triangleIdx, int originalTriangleIndex) const;
+
+		// varying data for the vertices of the triangle of the fan blended from the data of the original triangle
+		IShaderBase::TriangleVaryingData GetVaryingData(int triangleIdx, const IShaderBase::TriangleVaryingData& originalData) const;
+	};
+
+	enum class EClipResult : u8
+	{
+		CULLED,			// no part of the triangle can be visible
+		UNCLIPPED,		// the triangle can be rasterized as it is
+		CLIPPED			// only the polygon left after clipping can be rasterized
+	};
+
+	// Primitive assembly. Triangles completely outside of the view frustum are culled. Triangles crossing the near plane
+	// or reaching out of the guard band are clipped, anything else is left to the rasterizer to scissor to the screen
+	// which is far cheaper than clipping. The far plane is only used for culling.
+	EClipResult ClipTriangle(const Triangle& t, const Vec2i& outputSize, ClippedPolygon& polygon);
+}
@@ -2,6 +2,7 @@
 
 #include "geometry.h"
 #include "shader.h"
+#include "cpu_features.h"
 
 namespace sor
 {
@@ -70,6 +71,43 @@ namespace sor
 
 	const EScene SCENE = EScene::SIMPLE_PLANE;
 
+	enum class ERenderMode
+	{
+		IMMEDIATE,		// every triangle is rasterized right after its vertices are processed, on the calling thread
+		TILED,			// triangles are binned into screen tiles that are then rasterized and shaded in parallel
+		VISIBILITY_BUFFER,	// only depth and triangle ids are rasterized, visible pixels are then shaded once in parallel
+		SORT_LAST,		// contiguous slices of the triangles are drawn in parallel into private buffers that are then depth composited
+		DEPTH_PREPASS,	// depth of all triangles is rasterized first, then they're drawn again and only the visible fragments are shaded
+		WIREFRAME,		// only the edges of the model, every one of them drawn once
+		COUNT
+	};
+
+	const ERenderMode RENDER_MODE = ERenderMode::TILED;
+
+	// The renderers that set up all triangles of the frame at once (tiled, sort-last and visibility buffer) draw them
+	// from the nearest one instead of in the submission order, so the early depth test rejects more fragments.
+	const bool SORT_FRONT_TO_BACK = false;
+
+	// The wireframe render mode rasterizes the depth of the model first and draws only the edges in front of it. The
+	// bias pulls the edges closer so the ones of the visible triangles aren't hidden by the triangles themselves.
+	const bool WIREFRAME_HIDDEN_LINES = true;
+	constexpr float WIREFRAME_DEPTH_BIAS = 0.01f;
+
+	enum class ERasterizer
+	{
+		BLOCK,			// bounding box is walked hierarchically in blocks classified by the edge functions
+		SPAN,			// covered part of every row is computed directly and shaded as a span
+		AUTO,			// spans for thin triangles, blocks for everything else
+		COUNT
+	};
+
+	const ERasterizer RASTERIZER = ERasterizer::AUTO;
+
+	// widest instruction set the rasterizer kernels may use if the CPU supports it, lower it to compare against scalar code
+	const ESimdLevel MAX_RASTER_SIMD_LEVEL = ESimdLevel::AVX2;
+	// the same for the batched vertex transformations
+	const ESimdLevel MAX_VERTEX_SIMD_LEVEL = ESimdLevel::AVX2;
+
 	inline const char* MODEL_PATHS[(int) EScene::COUNT]
 	{
 		DIABLO_POSE_MODEL_PATH,
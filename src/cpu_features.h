@@ -0,0 +1,83 @@
+#pragma once
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SOR_SIMD_X86 1
+#else
+#define SOR_SIMD_X86 0
+#endif
+
+#if SOR_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// SSE2 is part of x86-64 so code compiled for it can use SSE2 anywhere without asking the CPU first
+#if SOR_SIMD_X86 && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define SOR_SSE2_BASELINE 1
+#else
+#define SOR_SSE2_BASELINE 0
+#endif
+
+// MSVC lets any function use any instruction set, GCC and Clang have to be told per function
+#if SOR_SIMD_X86 && !defined(_MSC_VER)
+#define SOR_TARGET_SSE2 __attribute__((target("sse2")))
+#define SOR_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define SOR_TARGET_SSE2
+#define SOR_TARGET_AVX2
+#endif
+
+namespace sor
+{
+	// ordered so that every level includes all the levels before it
+	enum class ESimdLevel
+	{
+		SCALAR,
+		SSE2,
+		AVX2
+	};
+
+	inline ESimdLevel DetectSimdLevel()
+	{
+#if SOR_SIMD_X86
+#if defined(_MSC_VER)
+		int cpuInfo[4];
+		__cpuid(cpuInfo, 0);
+		const int maxLeaf = cpuInfo[0];
+
+		__cpuid(cpuInfo, 1);
+		const bool hasSse2 = cpuInfo[3] & (1 << 26);
+		const bool hasOsxsave = cpuInfo[2] & (1 << 27);
+		const bool hasAvx = cpuInfo[2] & (1 << 28);
+
+		bool hasAvx2 = false;
+		// the OS has to save the upper halves of ymm registers on context switch for AVX to be usable
+		if (maxLeaf >= 7 && hasOsxsave && hasAvx && (_xgetbv(0) & 0x6) == 0x6)
+		{
+			__cpuidex(cpuInfo, 7, 0);
+			hasAvx2 = cpuInfo[1] & (1 << 5);
+		}
+#else
+		__builtin_cpu_init();
+		const bool hasSse2 = __builtin_cpu_supports("sse2");
+		const bool hasAvx2 = __builtin_cpu_supports("avx2");
+#endif
+		if (hasAvx2)
+			return ESimdLevel::AVX2;
+		if (hasSse2)
+			return ESimdLevel::SSE2;
+#endif
+		return ESimdLevel::SCALAR;
+	}
+
+	// detected once, the first time it's asked for
+	inline ESimdLevel GetSimdLevel()
+	{
+		static const ESimdLevel simdLevel = DetectSimdLevel();
+		return simdLevel;
+	}
+}
@@ -7,6 +7,7 @@
 #include <cmath>
 #include <ostream>
 
+#include "cpu_features.h"
 #include "types.h"
 
 namespace sor
@@ -109,9 +110,10 @@ namespace sor
 	constexpr Vec3f VUp = Vec3f{ 0, 1.0f, 0.f };
 	constexpr Vec3f VDown = Vec3f{ 0, -1.0f, 0.f };
 
+	// aligned so that a whole vector is a single SSE load, see the float specialisations at the end of the file
 	template
 		<typename T>
-		class Vector4
+		class alignas(16) Vector4
 	{
 	public:
 		Vector4()
@@ -130,7 +132,7 @@ namespace sor
 			: m_x(vec3.x), m_y(vec3.y), m_z(vec3.z), m_w(w) {
 		}
 
-		T dot(const Vector4& vec)
+		T dot(const Vector4& vec) const
 		{
 			return m_x * vec.m_x + m_y * vec.m_y + m_z * vec.m_z + m_w * vec.m_w;
 		}
@@ -160,18 +162,18 @@ namespace sor
 			return *this;
 		}
 
-		Vector4<T> operator-(const Vector4<T>& v)
+		Vector4<T> operator-(const Vector4<T>& v) const
 		{
 			return { m_x - v.x(), m_y - v.y(), m_z - v.z(), m_w - v.w() };
 		}
 
 
-		Vector4<T> operator+(const Vector4<T>& v)
+		Vector4<T> operator+(const Vector4<T>& v) const
 		{
 			return { m_x + v.x(), m_y + v.y(), m_z + v.z(), m_w + v.w() };
 		}
 
-		Vector4 operator*(Vector4 v) const
+		Vector4 operator*(const Vector4& v) const
 		{
 			return { m_x * v.x(), m_y * v.y(), m_z * v.z(), m_w * v.w() };
 		}
@@ -245,7 +247,7 @@ namespace sor
 
 	template
 		<typename T, u8 rows, u8 columns>
-		class MatrixGeneric
+		class alignas(16) MatrixGeneric
 	{
 	public:
 		static constexpr u8 row_count = rows;
@@ -285,7 +287,7 @@ namespace sor
 				rawMat[i][i] = static_cast<T>(1);
 		}
 
-		MatrixGeneric operator*(float scaler)
+		MatrixGeneric operator*(float scaler) const
 		{
 			MatrixGeneric mat{ *this };
 			mat *= scaler;
@@ -298,7 +300,7 @@ namespace sor
 				raw[i] *= scaler;
 		}
 
-		MatrixGeneric operator*(const MatrixGeneric& mat)
+		MatrixGeneric operator*(const MatrixGeneric& mat) const
 		{
 			static_assert(row_count == column_count);
 
@@ -318,9 +320,9 @@ namespace sor
 			return mat_;
 		}
 
-		ColumnArrType operator*(const ColumnArrType& arr)
+		ColumnArrType operator*(const ColumnArrType& arr) const
 		{
-			ColumnArrType retArr;
+			ColumnArrType retArr{};
 
 			for (int i = 0; i < row_count; i++)
 				for (int j = 0; j < column_count; j++)
@@ -489,7 +491,7 @@ namespace sor
 				return GetElement(0, 0);
 			else // it is important for this so the else clause doesn't compile for the row and column == 1 case
 			{
-				float D = 0; // Initialize determinant
+				T D = 0; // Initialize determinant
 				int sign = 1; // Alternating sign
 
 				using MinorMatrix_t = MatrixGeneric<T, row_count - 1, column_count - 1>;
@@ -558,18 +560,125 @@ namespace sor
 		}
 
 
-		MatrixGeneric GetInverse() const
+		// Writes the inverse and returns true, or returns false and leaves inverse alone if the matrix is singular. Safe
+		// to call per pixel: 2x2, 3x3 and 4x4 matrices are inverted in closed form with no recursion and no exceptions,
+		// 4x4 affine transformations (last row 0, 0, 0, 1) only by inverting their 3x3 part.
+		bool TryInverse(MatrixGeneric& inverse) const
 		{
-			float det = determinant();
-			if (det == 0.f)
-				throw std::runtime_error("Matrix is singular, inverse doesn't exist");
+			static_assert(row_count == column_count, "Inverse is only defined for square matrices");
 
-			MatrixGeneric adj = getAdjoint();
-			MatrixGeneric inverse;
+			const auto& m = rawMat;
+			const auto isInvertible = [](T det) { return det != static_cast<T>(0) && std::isfinite(det); };
+
+			if constexpr (row_count == 2)
+			{
+				const T det = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+				if (!isInvertible(det))
+					return false;
+
+				const T invDet = static_cast<T>(1) / det;
+				inverse.SetRow(0, { m[1][1] * invDet, -m[0][1] * invDet });
+				inverse.SetRow(1, { -m[1][0] * invDet, m[0][0] * invDet });
+				return true;
+			}
+			else if constexpr (row_count == 3)
+			{
+				// cofactors of the first row to expand the determinant along it, also the first column of the inverse
+				const T c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+				const T c10 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+				const T c20 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+				const T det = m[0][0] * c00 + m[0][1] * c10 + m[0][2] * c20;
+				if (!isInvertible(det))
+					return false;
+
+				const T invDet = static_cast<T>(1) / det;
+				inverse.SetRow(0, { c00 * invDet, (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet, (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet });
+				inverse.SetRow(1, { c10 * invDet, (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet, (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet });
+				inverse.SetRow(2, { c20 * invDet, (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet, (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet });
+				return true;
+			}
+			else if constexpr (row_count == 4)
+			{
+				if (m[3][0] == 0 && m[3][1] == 0 && m[3][2] == 0 && m[3][3] == 1)
+				{
+					// inverse of x' = Ax + t is x = A^-1 x' - A^-1 t
+					MatrixGeneric<T, 3, 3> linear;
+					for (int i = 0; i < 3; i++)
+						linear.SetRow(i, { m[i][0], m[i][1], m[i][2] });
+
+					MatrixGeneric<T, 3, 3> linearInverse;
+					if (!linear.TryInverse(linearInverse))
+						return false;
+
+					const std::array<T, 3> translation = linearInverse * std::array<T, 3>{ m[0][3], m[1][3], m[2][3] };
+					for (int i = 0; i < 3; i++)
+						inverse.SetRow(i, { linearInverse[i][0], linearInverse[i][1], linearInverse[i][2], -translation[i] });
+					inverse.SetRow(3, { 0, 0, 0, 1 });
+					return true;
+				}
+
+				// determinants of the 2x2 submatrices of the top two and the bottom two rows
+				const T s0 = m[0][0] * m[1][1] - m[1][0] * m[0][1];
+				const T s1 = m[0][0] * m[1][2] - m[1][0] * m[0][2];
+				const T s2 = m[0][0] * m[1][3] - m[1][0] * m[0][3];
+				const T s3 = m[0][1] * m[1][2] - m[1][1] * m[0][2];
+				const T s4 = m[0][1] * m[1][3] - m[1][1] * m[0][3];
+				const T s5 = m[0][2] * m[1][3] - m[1][2] * m[0][3];
+
+				const T c5 = m[2][2] * m[3][3] - m[3][2] * m[2][3];
+				const T c4 = m[2][1] * m[3][3] - m[3][1] * m[2][3];
+				const T c3 = m[2][1] * m[3][2] - m[3][1] * m[2][2];
+				const T c2 = m[2][0] * m[3][3] - m[3][0] * m[2][3];
+				const T c1 = m[2][0] * m[3][2] - m[3][0] * m[2][2];
+				const T c0 = m[2][0] * m[3][1] - m[3][0] * m[2][1];
+
+				const T det = s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+				if (!isInvertible(det))
+					return false;
+
+				const T invDet = static_cast<T>(1) / det;
+				inverse.SetRow(0, {
+					(m[1][1] * c5 - m[1][2] * c4 + m[1][3] * c3) * invDet,
+					(-m[0][1] * c5 + m[0][2] * c4 - m[0][3] * c3) * invDet,
+					(m[3][1] * s5 - m[3][2] * s4 + m[3][3] * s3) * invDet,
+					(-m[2][1] * s5 + m[2][2] * s4 - m[2][3] * s3) * invDet });
+				inverse.SetRow(1, {
+					(-m[1][0] * c5 + m[1][2] * c2 - m[1][3] * c1) * invDet,
+					(m[0][0] * c5 - m[0][2] * c2 + m[0][3] * c1) * invDet,
+					(-m[3][0] * s5 + m[3][2] * s2 - m[3][3] * s1) * invDet,
+					(m[2][0] * s5 - m[2][2] * s2 + m[2][3] * s1) * invDet });
+				inverse.SetRow(2, {
+					(m[1][0] * c4 - m[1][1] * c2 + m[1][3] * c0) * invDet,
+					(-m[0][0] * c4 + m[0][1] * c2 - m[0][3] * c0) * invDet,
+					(m[3][0] * s4 - m[3][1] * s2 + m[3][3] * s0) * invDet,
+					(-m[2][0] * s4 + m[2][1] * s2 - m[2][3] * s0) * invDet });
+				inverse.SetRow(3, {
+					(-m[1][0] * c3 + m[1][1] * c1 - m[1][2] * c0) * invDet,
+					(m[0][0] * c3 - m[0][1] * c1 + m[0][2] * c0) * invDet,
+					(-m[3][0] * s3 + m[3][1] * s1 - m[3][2] * s0) * invDet,
+					(m[2][0] * s3 - m[2][1] * s1 + m[2][2] * s0) * invDet });
+				return true;
+			}
+			else
+			{
+				const T det = determinant();
+				if (!isInvertible(det))
+					return false;
+
+				const MatrixGeneric adj = getAdjoint();
+				for (size_t i = 0; i < row_count; i++)
+					for (size_t j = 0; j < column_count; j++)
+						inverse[i][j] = adj.rawMat[i][j] / det;
 
-			for (size_t i = 0; i < row_count; i++)
-				for (size_t j = 0; j < column_count; j++)
-					inverse[i][j] = adj.rawMat[i][j] / det;
+				return true;
+			}
+		}
+
+		MatrixGeneric GetInverse() const
+		{
+			MatrixGeneric inverse;
+			if (!TryInverse(inverse))
+				throw std::runtime_error("Matrix is singular, inverse doesn't exist");
 
 			return inverse;
 		}
@@ -615,7 +724,7 @@ namespace sor
 			return Vec3<T>(BaseClassType::GetColumn(colIdx));
 		}
 
-		Vec3<T> operator*(const Vec3<T>& vec)
+		Vec3<T> operator*(const Vec3<T>& vec) const
 		{
 			return BaseClassType::operator*(std::array<T, 3> {vec.x, vec.y, vec.z});
 		}
@@ -648,7 +757,7 @@ namespace sor
 			BaseClassType::rawMat[3][0] = m30; BaseClassType::rawMat[3][1] = m31; BaseClassType::rawMat[3][2] = m32; BaseClassType::rawMat[3][3] = m33;
 		}
 
-		Matrix4x4(Vector4<T> row0, Vector4<T> row1, Vector4<T> row2, Vector4<T> row3)
+		Matrix4x4(const Vector4<T>& row0, const Vector4<T>& row1, const Vector4<T>& row2, const Vector4<T>& row3)
 		{
 			memcpy(BaseClassType::rawMat[0], row0.getRaw(), BaseClassType::row_size);
 			memcpy(BaseClassType::rawMat[1], row1.getRaw(), BaseClassType::row_size);
@@ -656,7 +765,7 @@ namespace sor
 			memcpy(BaseClassType::rawMat[3], row3.getRaw(), BaseClassType::row_size);
 		}
 
-		Vector4<T> operator*(const Vector4<T>& vec)
+		Vector4<T> operator*(const Vector4<T>& vec) const
 		{
 			return Vector4<T>
 			{
@@ -671,80 +780,28 @@ namespace sor
 		using BaseClassType::operator*;
 		using BaseClassType::operator*=;
 
-		Matrix4x4 operator*(const Matrix4x4& mat) { return BaseClassType::operator*(mat); }
-
-		Matrix4x4 GetInverse()
-		{
-			// taken from glm
-#define INVERSE_IMPLEMENTATION_GLM 0
-#define INVERSE_IMPLEMENTATION_BYHAND 1
-#define INVERSE_IMPLEMENTATION INVERSE_IMPLEMENTATION_BYHAND
-
-#if INVERSE_IMPLEMENTATION == INVERSE_IMPLEMENTATION_GLM
-
-			T Coef00 = BaseClassType::rawMat[2][2] * BaseClassType::rawMat[3][3] - BaseClassType::rawMat[3][2] * BaseClassType::rawMat[2][3];
-			T Coef02 = BaseClassType::rawMat[1][2] * BaseClassType::rawMat[3][3] - BaseClassType::rawMat[3][2] * BaseClassType::rawMat[1][3];
-			T Coef03 = BaseClassType::rawMat[1][2] * BaseClassType::rawMat[2][3] - BaseClassType::rawMat[2][2] * BaseClassType::rawMat[1][3];
-
-			T Coef04 = BaseClassType::rawMat[2][1] * BaseClassType::rawMat[3][3] - BaseClassType::rawMat[3][1] * BaseClassType::rawMat[2][3];
-			T Coef06 = BaseClassType::rawMat[1][1] * BaseClassType::rawMat[3][3] - BaseClassType::rawMat[3][1] * BaseClassType::rawMat[1][3];
-			T Coef07 = BaseClassType::rawMat[1][1] * BaseClassType::rawMat[2][3] - BaseClassType::rawMat[2][1] * BaseClassType::rawMat[1][3];
-
-			T Coef08 = BaseClassType::rawMat[2][1] * BaseClassType::rawMat[3][2] - BaseClassType::rawMat[3][1] * BaseClassType::rawMat[2][2];
-			T Coef10 = BaseClassType::rawMat[1][1] * BaseClassType::rawMat[3][2] - BaseClassType::rawMat[3][1] * BaseClassType::rawMat[1][2];
-			T Coef11 = BaseClassType::rawMat[1][1] * BaseClassType::rawMat[2][2] - BaseClassType::rawMat[2][1] * BaseClassType::rawMat[1][2];
-
-			T Coef12 = BaseClassType::rawMat[2][0] * BaseClassType::rawMat[3][3] - BaseClassType::rawMat[3][0] * BaseClassType::rawMat[2][3];
-			T Coef14 = BaseClassType::rawMat[1][0] * BaseClassType::rawMat[3][3] - BaseClassType::rawMat[3][0] * BaseClassType::rawMat[1][3];
-			T Coef15 = BaseClassType::rawMat[1][0] * BaseClassType::rawMat[2][3] - BaseClassType::rawMat[2][0] * BaseClassType::rawMat[1][3];
-
-			T Coef16 = BaseClassType::rawMat[2][0] * BaseClassType::rawMat[3][2] - BaseClassType::rawMat[3][0] * BaseClassType::rawMat[2][2];
-			T Coef18 = BaseClassType::rawMat[1][0] * BaseClassType::rawMat[3][2] - BaseClassType::rawMat[3][0] * BaseClassType::rawMat[1][2];
-			T Coef19 = BaseClassType::rawMat[1][0] * BaseClassType::rawMat[2][2] - BaseClassType::rawMat[2][0] * BaseClassType::rawMat[1][2];
+		Matrix4x4 operator*(const Matrix4x4& mat) const { return BaseClassType::operator*(mat); }
 
-			T Coef20 = BaseClassType::rawMat[2][0] * BaseClassType::rawMat[3][1] - BaseClassType::rawMat[3][0] * BaseClassType::rawMat[2][1];
-			T Coef22 = BaseClassType::rawMat[1][0] * BaseClassType::rawMat[3][1] - BaseClassType::rawMat[3][0] * BaseClassType::rawMat[1][1];
-			T Coef23 = BaseClassType::rawMat[1][0] * BaseClassType::rawMat[2][1] - BaseClassType::rawMat[2][0] * BaseClassType::rawMat[1][1];
+		Matrix4x4 GetInverse() const { return BaseClassType::GetInverse(); }
 
-			Vector4<T> Fac0(Coef00, Coef00, Coef02, Coef03);
-			Vector4<T> Fac1(Coef04, Coef04, Coef06, Coef07);
-			Vector4<T> Fac2(Coef08, Coef08, Coef10, Coef11);
-			Vector4<T> Fac3(Coef12, Coef12, Coef14, Coef15);
-			Vector4<T> Fac4(Coef16, Coef16, Coef18, Coef19);
-			Vector4<T> Fac5(Coef20, Coef20, Coef22, Coef23);
-
-			Vector4<T> Vec0(BaseClassType::rawMat[1][0], BaseClassType::rawMat[0][0], BaseClassType::rawMat[0][0], BaseClassType::rawMat[0][0]);
-			Vector4<T> Vec1(BaseClassType::rawMat[1][1], BaseClassType::rawMat[0][1], BaseClassType::rawMat[0][1], BaseClassType::rawMat[0][1]);
-			Vector4<T> Vec2(BaseClassType::rawMat[1][2], BaseClassType::rawMat[0][2], BaseClassType::rawMat[0][2], BaseClassType::rawMat[0][2]);
-			Vector4<T> Vec3(BaseClassType::rawMat[1][3], BaseClassType::rawMat[0][3], BaseClassType::rawMat[0][3], BaseClassType::rawMat[0][3]);
-
-			Vector4<T> Inv0(Vec1 * Fac0 - Vec2 * Fac1 + Vec3 * Fac2);
-			Vector4<T> Inv1(Vec0 * Fac0 - Vec2 * Fac3 + Vec3 * Fac4);
-			Vector4<T> Inv2(Vec0 * Fac1 - Vec1 * Fac3 + Vec3 * Fac5);
-			Vector4<T> Inv3(Vec0 * Fac2 - Vec1 * Fac4 + Vec2 * Fac5);
-
-			Vector4<T> SignA(+1, -1, +1, -1);
-			Vector4<T> SignB(-1, +1, -1, +1);
-
-			Matrix4x4<T> Inverse(Inv0 * SignA, Inv1 * SignB, Inv2 * SignA, Inv3 * SignB);
-			Inverse = Inverse.GetTranspose();
-
-			Vector4<T> Row0(Inverse[0][0], Inverse[1][0], Inverse[2][0], Inverse[3][0]);
-
-			Vector4<T> Dot0(Vector4<T>(BaseClassType::rawMat[0]) * Row0);
-			T Dot1 = (Dot0.x() + Dot0.y()) + (Dot0.z() + Dot0.w());
-
-			T OneOverDeterminant = static_cast<T>(1) / Dot1;
-
-			return Inverse * OneOverDeterminant;
-#elif INVERSE_IMPLEMENTATION == INVERSE_IMPLEMENTATION_BYHAND
-			return BaseClassType::GetInverse();
+		// Inverse of a rotation followed by a translation, the caller has to know the matrix is one (a view matrix for
+		// example), it isn't checked. The rotation is only transposed.
+		Matrix4x4 GetRigidInverse() const
+		{
+			const auto& m = BaseClassType::rawMat;
 
-#endif
+			Matrix4x4 inverse;
+			for (int i = 0; i < 3; i++)
+			{
+				const T translation = m[0][i] * m[0][3] + m[1][i] * m[1][3] + m[2][i] * m[2][3];
+				inverse.SetRow(i, Vector4<T>{ m[0][i], m[1][i], m[2][i], -translation });
+			}
+			inverse.SetRow(3, Vector4<T>{ 0, 0, 0, 1 });
 
+			return inverse;
 		}
 
-		Matrix4x4 GetTranspose()
+		Matrix4x4 GetTranspose() const
 		{
 			Matrix4x4 transposed;
 			transposed.SetColumn(0, BaseClassType::rawMat[0]);
@@ -755,9 +812,9 @@ namespace sor
 			return transposed;
 		}
 
-		void SetColumn(int column_idx, Vector4<T> column)
+		void SetColumn(int column_idx, const Vector4<T>& column)
 		{
-			BaseClassType::SetColumn(column_idx, std::to_array<T, BaseClassType::row_count>(column.getRaw()));
+			BaseClassType::SetColumn(column_idx, std::to_array(column.getRaw()));
 		}
 
 		void SetRow(int rowIdx, const Vec3<T>& row)
@@ -774,6 +831,87 @@ namespace sor
 
 
 
+#if SOR_SSE2_BASELINE
+	// SSE versions of the float operations all transformations go through, from building the camera matrices to
+	// the fragment shaders. Every lane adds the products in the same order as the generic code, so the results are
+	// the same to the bit.
+
+	// lane i holds ((v[i].x + v[i].y) + v[i].z) + v[i].w
+	inline __m128 SumLanes(__m128 v0, __m128 v1, __m128 v2, __m128 v3)
+	{
+		_MM_TRANSPOSE4_PS(v0, v1, v2, v3);
+		return _mm_add_ps(_mm_add_ps(_mm_add_ps(v0, v1), v2), v3);
+	}
+
+	inline Vector4<float> ToVec4f(__m128 v)
+	{
+		Vector4<float> vec;
+		_mm_store_ps(vec.getRaw(), v);
+		return vec;
+	}
+
+	template <>
+	inline float Vector4<float>::dot(const Vector4<float>& vec) const
+	{
+		alignas(16) float products[4];
+		_mm_store_ps(products, _mm_mul_ps(_mm_load_ps(m_raw), _mm_load_ps(vec.m_raw)));
+		return ((products[0] + products[1]) + products[2]) + products[3];
+	}
+
+	template <>
+	inline Vector4<float> Vector4<float>::operator*(float scalar) const
+	{
+		return ToVec4f(_mm_mul_ps(_mm_load_ps(m_raw), _mm_set1_ps(scalar)));
+	}
+
+	template <>
+	inline Vector4<float> Vector4<float>::operator*(const Vector4<float>& v) const
+	{
+		return ToVec4f(_mm_mul_ps(_mm_load_ps(m_raw), _mm_load_ps(v.m_raw)));
+	}
+
+	template <>
+	inline Vector4<float> Vector4<float>::operator+(const Vector4<float>& v) const
+	{
+		return ToVec4f(_mm_add_ps(_mm_load_ps(m_raw), _mm_load_ps(v.m_raw)));
+	}
+
+	template <>
+	inline Vector4<float> Vector4<float>::operator-(const Vector4<float>& v) const
+	{
+		return ToVec4f(_mm_sub_ps(_mm_load_ps(m_raw), _mm_load_ps(v.m_raw)));
+	}
+
+	// every row of the result is the rows of mat scaled by the elements of the row of this matrix, added up from zero
+	// like the dot products of the generic version
+	template <>
+	inline MatrixGeneric<float, 4, 4> MatrixGeneric<float, 4, 4>::operator*(const MatrixGeneric<float, 4, 4>& mat) const
+	{
+		const __m128 matRows[4]{ _mm_load_ps(mat.rawMat[0]), _mm_load_ps(mat.rawMat[1]),
+			_mm_load_ps(mat.rawMat[2]), _mm_load_ps(mat.rawMat[3]) };
+
+		MatrixGeneric<float, 4, 4> result;
+		for (int i = 0; i < 4; i++)
+		{
+			__m128 row = _mm_setzero_ps();
+			for (int k = 0; k < 4; k++)
+				row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(rawMat[i][k]), matRows[k]));
+
+			_mm_store_ps(result.rawMat[i], row);
+		}
+
+		return result;
+	}
+
+	template <>
+	inline Vector4<float> Matrix4x4<float>::operator*(const Vector4<float>& vec) const
+	{
+		const __m128 v = _mm_load_ps(vec.getRaw());
+		return ToVec4f(SumLanes(_mm_mul_ps(_mm_load_ps(rawMat[0]), v), _mm_mul_ps(_mm_load_ps(rawMat[1]), v),
+			_mm_mul_ps(_mm_load_ps(rawMat[2]), v), _mm_mul_ps(_mm_load_ps(rawMat[3]), v)));
+	}
+#endif
+
 	using Vec4f = Vector4<float>;
 	using Mat4 = Matrix4x4<float>;
 
@@ -0,0 +1,121 @@
+#include "line_drawing.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include "z_buffer.h"
+
+namespace sor
+{
+	namespace
+	{
+		// rectangle lines are clipped to, pixel centers of the output
+		void GetClipRectangle(const Texture& output, Vec2f& min, Vec2f& max)
+		{
+			min = { 0.f, 0.f };
+			max = { static_cast<float>(output.GetWidth() - 1), static_cast<float>(output.GetHeight() - 1) };
+		}
+
+		// Rounded to the nearest pixel. Clipped points can still end up a bit outside of the output when the line is
+		// far longer than the output and the float math rounds them out so they're clamped to it.
+		Vec2i ToPixel(float x, float y, const Texture& output)
+		{
+			return {
+				std::clamp(static_cast<int>(std::lround(x)), 0, output.GetWidth() - 1),
+				std::clamp(static_cast<int>(std::lround(y)), 0, output.GetHeight() - 1) };
+		}
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	bool ClipLine(const Vec2f& p0, const Vec2f& p1, const Vec2f& min, const Vec2f& max, float& tStart, float& tEnd)
+	{
+		const float deltaX = p1.x - p0.x;
+		const float deltaY = p1.y - p0.y;
+
+		// NaN is ignored by the min and max below and infinity gives NaN there, also covers lines too long for a float
+		if (!std::isfinite(p0.x) || !std::isfinite(p0.y) || !std::isfinite(deltaX) || !std::isfinite(deltaY))
+			return false;
+
+		// for every side p * t <= q has to hold for the point at t to be on the inner side of it
+		const std::array<float, 4> p{ -deltaX, deltaX, -deltaY, deltaY };
+		const std::array<float, 4> q{ p0.x - min.x, max.x - p0.x, p0.y - min.y, max.y - p0.y };
+
+		tStart = 0.f;
+		tEnd = 1.f;
+		for (int side = 0; side < 4; side++)
+		{
+			if (p[side] == 0.f)
+			{
+				// parallel with the side, either completely outside or it doesn't limit the line at all
+				if (!(q[side] >= 0.f))
+					return false;
+				continue;
+			}
+
+			const float t = q[side] / p[side];
+			if (p[side] < 0.f)
+				tStart = std::max(tStart, t);
+			else
+				tEnd = std::min(tEnd, t);
+		}
+
+		return tStart <= tEnd;
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void DrawLine(int x0, int y0, int x1, int y1, Texture& output, TGAColor color)
+	{
+		Vec2f min, max;
+		GetClipRectangle(output, min, max);
+
+		const Vec2f p0{ static_cast<float>(x0), static_cast<float>(y0) };
+		const Vec2f p1{ static_cast<float>(x1), static_cast<float>(y1) };
+		float tStart, tEnd;
+		if (!ClipLine(p0, p1, min, max, tStart, tEnd))
+			return;
+
+		const Vec2i start = tStart > 0.f ? ToPixel(p0.x + (p1.x - p0.x) * tStart, p0.y + (p1.y - p0.y) * tStart, output) : Vec2i{ x0, y0 };
+		const Vec2i end = tEnd < 1.f ? ToPixel(p0.x + (p1.x - p0.x) * tEnd, p0.y + (p1.y - p0.y) * tEnd, output) : Vec2i{ x1, y1 };
+
+		ForEachLinePixel(start.x, start.y, end.x, end.y, output, color, [](int x, int y, Texture& target, const TGAColor& lineColor)
+		{
+			target.SetPixelUnchecked(x, y, lineColor);
+		});
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void DrawLines(std::span<const LineSegment> segments, Texture& output, const ZBufferBase* depthBuffer, float depthBias)
+	{
+		Vec2f min, max;
+		GetClipRectangle(output, min, max);
+
+		for (const LineSegment& segment : segments)
+		{
+			const Vec2f p0{ segment.start.x, segment.start.y };
+			const Vec2f p1{ segment.end.x, segment.end.y };
+			float tStart, tEnd;
+			if (!ClipLine(p0, p1, min, max, tStart, tEnd))
+				continue;
+
+			const Vec3f delta = segment.end - segment.start;
+			const Vec3f clippedStart = segment.start + delta * tStart;
+			const Vec3f clippedEnd = segment.start + delta * tEnd;
+			const Vec2i start = ToPixel(clippedStart.x, clippedStart.y, output);
+			const Vec2i end = ToPixel(clippedEnd.x, clippedEnd.y, output);
+
+			// every step moves along the longer axis so that's how many there are
+			const int stepCount = std::max(std::abs(end.x - start.x), std::abs(end.y - start.y));
+			const float depthStep = stepCount > 0 ? (clippedEnd.z - clippedStart.z) / static_cast<float>(stepCount) : 0.f;
+			float depth = clippedStart.z - depthBias;
+
+			ForEachLinePixel(start.x, start.y, end.x, end.y, output, segment.color,
+				[depthBuffer, depthStep, &depth](int x, int y, Texture& target, const TGAColor& lineColor)
+			{
+				if (depthBuffer == nullptr || depthBuffer->Test(x, y, depth))
+					target.SetPixelUnchecked(x, y, lineColor);
+				depth += depthStep;
+			});
+		}
+	}
+}
@@ -1,47 +1,51 @@
 #pragma once
 
+#include <cstdlib>
 #include <functional>
+#include <span>
 
 #include "tgaimage.h"
 #include "Instrumentor.h"
 
 namespace sor
 {
+	class ZBufferBase;
+
 	void inline PutPointToImage(int x, int y, Texture& output, TGAColor color)
 	{
 		output.SetPixel(x, y, color);
 	}
 
+	// Calls pixelFunc for every pixel of the line from (x0, y0) to (x1, y1), both end points included. Integer Bresenham,
+	// the error term is kept doubled so it never needs fractions. Every step moves along the longer axis so pixelFunc is
+	// called max(|x1 - x0|, |y1 - y0|) + 1 times. The pixels aren't checked against the output in any way.
 	template
 		<typename Tfunc>
 		void ForEachLinePixel(int x0, int y0, int x1, int y1, Texture& output, TGAColor color, Tfunc pixelFunc)
 	{
-		PROFILE_FUNCTION()
+		const int rangeX = std::abs(x1 - x0);
+		const int rangeY = -std::abs(y1 - y0);
+		const int incX = x0 < x1 ? 1 : -1;
+		const int incY = y0 < y1 ? 1 : -1;
 
-			int rangeY = y1 - y0;
-		int rangeX = x1 - x0;
+		int error = rangeX + rangeY;
+		for (int x = x0, y = y0; ; )
+		{
+			pixelFunc(x, y, output, color);
 
-		const float dx = rangeY == 0 ? 1.f : static_cast<float>(rangeX) / abs(static_cast<float>(rangeY));
-		const float dy = rangeX == 0 ? 1.f : static_cast<float>(rangeY) / abs(static_cast<float>(rangeX));
+			if (x == x1 && y == y1)
+				break;
 
-		//printf("Starting line from (%d, %d) to (%d, %d); rangeX: %d, rangeY: %d, dx: %f, dy: %f .\n", x0, y0, x1, y1, rangeX, rangeY, dx, dy);
-
-		if (std::abs(dx) > std::abs(dy))
-		{
-			float y = y0;
-			int incX = rangeX > 0 ? 1 : -1;
-			for (int x = x0; rangeX > 0 ? x < x1 : x > x1; x += incX, y += dy)
+			const int doubledError = 2 * error;
+			if (doubledError >= rangeY)
 			{
-				pixelFunc(x, static_cast<int>(y), output, color);
+				error += rangeY;
+				x += incX;
 			}
-		}
-		else
-		{
-			float x = x0;
-			int incY = rangeY > 0 ? 1 : -1;
-			for (int y = y0; rangeY > 0 ? y < y1 : y > y1; y += incY, x += dx)
+			if (doubledError <= rangeX)
 			{
-				pixelFunc(static_cast<int>(x), y, output, color);
+				error += rangeX;
+				y += incY;
 			}
 		}
 	}
@@ -110,8 +114,24 @@ namespace sor
 		}
 	}*/
 
-	void inline DrawLine(int x0, int y0, int x1, int y1, Texture& output, TGAColor color)
+	// Liang-Barsky, finds the part of the line from p0 to p1 inside of the rectangle [min, max] as the range of the line
+	// parameter [tStart, tEnd] within [0, 1]. Returns false if no part of the line is inside or an end point isn't finite.
+	bool ClipLine(const Vec2f& p0, const Vec2f& p1, const Vec2f& min, const Vec2f& max, float& tStart, float& tEnd);
+
+	// same as ForEachLinePixel with PutPointToImage but the line is clipped to the output first instead of checking every pixel
+	void DrawLine(int x0, int y0, int x1, int y1, Texture& output, TGAColor color);
+
+	// line with both end points in pixel coordinates, z is the depth used for depth testing
+	struct LineSegment
 	{
-		ForEachLinePixel(x0, y0, x1, y1, output, color, PutPointToImage);
-	}
+		Vec3f start;
+		Vec3f end;
+		TGAColor color;
+	};
+
+	// Draws all segments, each is clipped to the output and rasterized with ForEachLinePixel. With a depth buffer the
+	// pixels are drawn only where the line is in front of what's in it, the depth isn't written. Depth of the
+	// line is pulled closer by depthBias so lines lying on a drawn surface aren't hidden by it.
+	void DrawLines(std::span<const LineSegment> segments, Texture& output, const ZBufferBase* depthBuffer = nullptr,
+		float depthBias = 0.f);
 }
@@ -0,0 +1,300 @@
+#include "mesh_clusters.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+#include "constants.h"
+#include "Instrumentor.h"
+
+namespace sor
+{
+	namespace
+	{
+		constexpr u32 NO_CLUSTER = std::numeric_limits<u32>::max();
+
+		using Plane = std::array<float, 4>;	// a, b, c, d of ax + by + cz + d, positive on the inner side
+
+		// x, y or w of a model space point transformed by the matrix row
+		float TransformByRow(const Plane& row, const Vec3f& p)
+		{
+			return row[0] * p.x + row[1] * p.y + row[2] * p.z + row[3];
+		}
+
+		// doubled signed area the face culler tests, scaled by the w of all three vertices
+		float GetProjectedDeterminant(const Plane& rowX, const Plane& rowY, const Plane& rowW, const std::array<Vec3f, 3>& face)
+		{
+			std::array<float, 3> x, y, w;
+			for (int i = 0; i < 3; i++)
+			{
+				x[i] = TransformByRow(rowX, face[i]);
+				y[i] = TransformByRow(rowY, face[i]);
+				w[i] = TransformByRow(rowW, face[i]);
+			}
+
+			return x[0] * (y[1] * w[2] - y[2] * w[1]) + x[1] * (y[2] * w[0] - y[0] * w[2]) + x[2] * (y[0] * w[1] - y[1] * w[0]);
+		}
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void MeshClusters::Build(const Model& model)
+	{
+		const int faceCount = model.nfaces();
+
+		// every face edge with its face, sorted by both vertex indices of the edge so the faces sharing it are next to
+		// each other
+		std::vector<std::pair<u64, u32>> edgeFaces;
+		edgeFaces.reserve(static_cast<size_t>(faceCount) * 3);
+		for (int faceIdx = 0; faceIdx < faceCount; faceIdx++)
+		{
+			for (u8 i = 0; i < 3; i++)
+			{
+				const u32 v0 = static_cast<u32>(model.VertexIndexForFace(faceIdx, i));
+				const u32 v1 = static_cast<u32>(model.VertexIndexForFace(faceIdx, static_cast<u8>((i + 1) % 3)));
+				edgeFaces.push_back({ static_cast<u64>(std::min(v0, v1)) << 32 | std::max(v0, v1), static_cast<u32>(faceIdx) });
+			}
+		}
+		std::sort(edgeFaces.begin(), edgeFaces.end());
+
+		// neighbours of every face, the ones of face i are [neighbourOffsets[i], neighbourOffsets[i + 1])
+		std::vector<u32> neighbourOffsets(faceCount + 1, 0);
+		std::vector<u32> neighbours;
+		for (int pass = 0; pass < 2; pass++)
+		{
+			std::vector<u32> writeOffsets;
+			if (pass == 1)
+			{
+				for (int faceIdx = 0; faceIdx < faceCount; faceIdx++)
+					neighbourOffsets[faceIdx + 1] += neighbourOffsets[faceIdx];
+				neighbours.resize(neighbourOffsets[faceCount]);
+				writeOffsets.assign(neighbourOffsets.begin(), neighbourOffsets.end() - 1);
+			}
+
+			for (size_t runBegin = 0; runBegin < edgeFaces.size(); )
+			{
+				size_t runEnd = runBegin + 1;
+				while (runEnd < edgeFaces.size() && edgeFaces[runEnd].first == edgeFaces[runBegin].first)
+					runEnd++;
+
+				for (size_t i = runBegin; i < runEnd; i++)
+				{
+					for (size_t j = runBegin; j < runEnd; j++)
+					{
+						if (i == j)
+							continue;
+
+						if (pass == 0)
+							neighbourOffsets[edgeFaces[i].second + 1]++;
+						else
+							neighbours[writeOffsets[edgeFaces[i].second]++] = edgeFaces[j].second;
+					}
+				}
+				runBegin = runEnd;
+			}
+		}
+
+		m_Clusters.clear();
+		m_FaceClusters.assign(faceCount, NO_CLUSTER);
+		std::vector<u32> queue;
+		std::vector<u32> clusterFaces;
+		for (int seed = 0; seed < faceCount; seed++)
+		{
+			if (m_FaceClusters[seed] != NO_CLUSTER)
+				continue;
+
+			const u32 clusterIdx = static_cast<u32>(m_Clusters.size());
+			queue.assign(1, static_cast<u32>(seed));
+			clusterFaces.clear();
+			for (size_t queueIdx = 0; queueIdx < queue.size() && clusterFaces.size() < MESH_CLUSTER_MAX_FACE_COUNT; queueIdx++)
+			{
+				const u32 faceIdx = queue[queueIdx];
+				if (m_FaceClusters[faceIdx] != NO_CLUSTER)
+					continue;
+
+				m_FaceClusters[faceIdx] = clusterIdx;
+				clusterFaces.push_back(faceIdx);
+				for (u32 i = neighbourOffsets[faceIdx]; i < neighbourOffsets[faceIdx + 1]; i++)
+				{
+					if (m_FaceClusters[neighbours[i]] == NO_CLUSTER)
+						queue.push_back(neighbours[i]);
+				}
+			}
+
+			// bounding sphere around the center of the bounding box
+			Vec3f min{ std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+			Vec3f max{ -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() };
+			for (const u32 faceIdx : clusterFaces)
+			{
+				for (u8 i = 0; i < 3; i++)
+				{
+					const Vec3f v = model.vert(model.VertexIndexForFace(faceIdx, i));
+					min = { std::min(min.x, v.x), std::min(min.y, v.y), std::min(min.z, v.z) };
+					max = { std::max(max.x, v.x), std::max(max.y, v.y), std::max(max.z, v.z) };
+				}
+			}
+
+			Cluster cluster;
+			cluster.center = (min + max) * 0.5f;
+			cluster.radius = 0.f;
+			for (const u32 faceIdx : clusterFaces)
+			{
+				for (u8 i = 0; i < 3; i++)
+					cluster.radius = std::max(cluster.radius, (model.vert(model.VertexIndexForFace(faceIdx, i)) - cluster.center).magnitude());
+			}
+
+			// Normal cone around the average normal. Faces with no area don't have a normal, the face culler drops them
+			// anyway. A cone wider than a half space can't tell the faces are all facing away from anywhere.
+			Vec3f normalSum;
+			for (const u32 faceIdx : clusterFaces)
+			{
+				const Vec3f v0 = model.vert(model.VertexIndexForFace(faceIdx, 0));
+				const Vec3f normal = (model.vert(model.VertexIndexForFace(faceIdx, 1)) - v0).cross(model.vert(model.VertexIndexForFace(faceIdx, 2)) - v0);
+				const float length = normal.magnitude();
+				if (length > 0.f)
+					normalSum = normalSum + normal / length;
+			}
+
+			cluster.coneAxis = Vec3f{};
+			cluster.coneCutoff = 2.f;
+			const float normalSumLength = normalSum.magnitude();
+			if (normalSumLength > 0.f)
+			{
+				cluster.coneAxis = normalSum / normalSumLength;
+
+				float minDot = 1.f;
+				for (const u32 faceIdx : clusterFaces)
+				{
+					const Vec3f v0 = model.vert(model.VertexIndexForFace(faceIdx, 0));
+					const Vec3f normal = (model.vert(model.VertexIndexForFace(faceIdx, 1)) - v0).cross(model.vert(model.VertexIndexForFace(faceIdx, 2)) - v0);
+					const float length = normal.magnitude();
+					if (length > 0.f)
+						minDot = std::min(minDot, cluster.coneAxis * normal / length);
+				}
+
+				if (minDot > 0.f)
+					cluster.coneCutoff = std::sqrt(1.f - minDot * minDot);
+			}
+
+			m_Clusters.push_back(cluster);
+		}
+
+		m_ClusterVisible.resize(m_Clusters.size());
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void MeshClusters::Cull(const Mat4& modelToScreen, const Vec2i& outputSize, const ZBufferBase* occluders)
+	{
+		PROFILE_SCOPE("MeshClusters::Cull")
+
+		std::array<Plane, 4> rows;
+		for (int row = 0; row < 4; row++)
+		{
+			for (int column = 0; column < 4; column++)
+				rows[row][column] = modelToScreen.GetElement(row, column);
+		}
+		const Plane& rowX = rows[0];
+		const Plane& rowY = rows[1];
+		const Plane& rowW = rows[3];
+
+		// Frustum planes in model space straight from the rows, the same planes ClipTriangle uses (x >= 0,
+		// x <= width * w etc.), normalized so the distance of the sphere center can be compared with its radius.
+		const float width = static_cast<float>(outputSize.x);
+		const float height = static_cast<float>(outputSize.y);
+		std::array<Plane, 6> frustumPlanes{
+			Plane{ rowW[0], rowW[1], rowW[2], rowW[3] - NEAR_PLANE },
+			Plane{ -rowW[0], -rowW[1], -rowW[2], FAR_PLANE - rowW[3] },
+			rowX,
+			Plane{ width * rowW[0] - rowX[0], width * rowW[1] - rowX[1], width * rowW[2] - rowX[2], width * rowW[3] - rowX[3] },
+			rowY,
+			Plane{ height * rowW[0] - rowY[0], height * rowW[1] - rowY[1], height * rowW[2] - rowY[2], height * rowW[3] - rowY[3] } };
+		for (Plane& plane : frustumPlanes)
+		{
+			const float length = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+			if (length > 0.f)
+			{
+				for (float& value : plane)
+					value /= length;
+			}
+		}
+
+		// The camera is the point the projection divides everything by, where x, y and w are all zero. Cramer's rule
+		// on the rows, in model space.
+		const auto determinant3 = [](const Vec3f& a, const Vec3f& b, const Vec3f& c) { return a * b.cross(c); };
+		const Vec3f columnX{ rowX[0], rowY[0], rowW[0] };
+		const Vec3f columnY{ rowX[1], rowY[1], rowW[1] };
+		const Vec3f columnZ{ rowX[2], rowY[2], rowW[2] };
+		const Vec3f constants{ -rowX[3], -rowY[3], -rowW[3] };
+		const float systemDeterminant = determinant3(columnX, columnY, columnZ);
+		const bool hasCamera = systemDeterminant != 0.f;
+		const Vec3f camera = hasCamera ? Vec3f{ determinant3(constants, columnY, columnZ), determinant3(columnX, constants, columnZ),
+			determinant3(columnX, columnY, constants) } / systemDeterminant : Vec3f{};
+
+		// Which way the normals of the faces the face culler drops point depends on the handedness of the whole
+		// transformation, a model matrix that mirrors flips it. It's taken from a face with a known normal, (1, 1, 1)
+		// pointing away from the camera, instead of working it out from the matrices.
+		const std::array<Vec3f, 3> probeFace{ camera + Vec3f{ 1.f, 0.f, 0.f }, camera + Vec3f{ 0.f, 1.f, 0.f }, camera + Vec3f{ 0.f, 0.f, 1.f } };
+		const float awayFacingSign = GetProjectedDeterminant(rowX, rowY, rowW, probeFace) >= 0.f ? 1.f : -1.f;
+
+		for (size_t clusterIdx = 0; clusterIdx < m_Clusters.size(); clusterIdx++)
+		{
+			const Cluster& cluster = m_Clusters[clusterIdx];
+			bool visible = true;
+
+			for (const Plane& plane : frustumPlanes)
+				visible &= TransformByRow(plane, cluster.center) >= -cluster.radius;
+
+			// all normals point away from the camera as seen from anywhere in the sphere
+			if (visible && hasCamera)
+			{
+				const Vec3f toCluster = cluster.center - camera;
+				visible = toCluster * cluster.coneAxis * awayFacingSign < cluster.coneCutoff * toCluster.magnitude() + cluster.radius;
+			}
+
+			// the box around the sphere, only if it's all in front of the camera so its corners can be projected
+			if (visible && occluders != nullptr)
+			{
+				Vec2f screenMin{ std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+				Vec2f screenMax{ -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() };
+				float nearestDepth = std::numeric_limits<float>::max();
+				float farthestDepth = 0.f;
+				bool inFront = true;
+				for (int corner = 0; corner < 8; corner++)
+				{
+					const Vec3f p = cluster.center + Vec3f{ corner & 1 ? cluster.radius : -cluster.radius,
+						corner & 2 ? cluster.radius : -cluster.radius, corner & 4 ? cluster.radius : -cluster.radius };
+					const float w = TransformByRow(rowW, p);
+					inFront &= w >= NEAR_PLANE;
+
+					const float x = TransformByRow(rowX, p) / w;
+					const float y = TransformByRow(rowY, p) / w;
+					const float depth = TransformByRow(rows[2], p) / w;
+					screenMin = { std::min(screenMin.x, x), std::min(screenMin.y, y) };
+					screenMax = { std::max(screenMax.x, x), std::max(screenMax.y, y) };
+					nearestDepth = std::min(nearestDepth, depth);
+					farthestDepth = std::max(farthestDepth, std::abs(depth));
+				}
+
+				if (inFront)
+				{
+					// a pixel more on every side, the rasterizer snaps the vertices
+					const Vec2i min{ std::max(static_cast<int>(std::floor(screenMin.x)) - 1, 0), std::max(static_cast<int>(std::floor(screenMin.y)) - 1, 0) };
+					const Vec2i max{ std::min(static_cast<int>(std::floor(screenMax.x)) + 1, outputSize.x - 1),
+						std::min(static_cast<int>(std::floor(screenMax.y)) + 1, outputSize.y - 1) };
+					if (min.x <= max.x && min.y <= max.y)
+						visible = !occluders->IsOccluded(min, max, nearestDepth - HI_Z_DEPTH_MARGIN * farthestDepth);
+				}
+			}
+
+			m_ClusterVisible[clusterIdx] = visible ? 1 : 0;
+		}
+
+		m_VisibleFaces.clear();
+		for (u32 faceIdx = 0; faceIdx < static_cast<u32>(m_FaceClusters.size()); faceIdx++)
+		{
+			if (m_ClusterVisible[m_FaceClusters[faceIdx]])
+				m_VisibleFaces.push_back(faceIdx);
+		}
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <span>
+#include <vector>
+
+#include "geometry.h"
+#include "model.h"
+#include "z_buffer.h"
+
+namespace sor
+{
+	// most faces one cluster is grown to
+	constexpr int MESH_CLUSTER_MAX_FACE_COUNT = 128;
+
+	//--------------------------------------------------------------------------------------------------
+	// Model split into clusters of neighbouring faces, built once when the model is loaded. Every cluster has a bounding
+	// sphere and a cone that holds the normals of all its faces so whole clusters can be culled every frame before any
+	// of their faces is looked at:
+	//  - clusters outside of the view frustum, by their sphere
+	//  - clusters with all faces facing away from the camera, by their normal cone
+	//  - optionally clusters hidden behind what's already in a z-buffer, by the hierarchical z-buffer
+	class MeshClusters
+	{
+	public:
+		// Faces are added to a cluster breadth first over the edges they share, starting from the first face that isn't
+		// in any cluster yet, so the clusters are compact patches of the surface.
+		void Build(const Model& model);
+
+		// modelToScreen is the whole transformation of the model vertices up to and including the viewport, before the
+		// perspective division. With occluders the clusters are also tested against its hierarchical z-buffer, that's only
+		// of any use if it already holds the final depth of the frame (after a depth prepass).
+		void Cull(const Mat4& modelToScreen, const Vec2i& outputSize, const ZBufferBase* occluders);
+
+		// faces of all clusters that survived culling, in the order of the model
+		std::span<const u32> GetVisibleFaces() const { return m_VisibleFaces; }
+
+		int GetClusterCount() const { return static_cast<int>(m_Clusters.size()); }
+
+	private:
+		struct Cluster
+		{
+			Vec3f center;		// of the bounding sphere, in model space
+			float radius;
+			Vec3f coneAxis;		// normalized average of the normals of the faces
+			float coneCutoff;	// sine of the widest angle of a normal from the axis, more than 1 if the cone can't cull
+		};
+
+		std::vector<Cluster> m_Clusters;
+		std::vector<u32> m_FaceClusters;	// cluster of every face
+		std::vector<u8> m_ClusterVisible;
+		std::vector<u32> m_VisibleFaces;
+	};
+}
@@ -2,6 +2,7 @@
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 #include "model.h"
 #include "types.h"
@@ -77,28 +78,84 @@ namespace sor
 		//for (int uvidx: uvidxs)
 		//    uvs_.push_back(uvs[uvidx-1]);
 
-		std::cerr << "# v# " << verts_.size() << " f# " << faces_.size() << std::endl;
+		BuildUniqueVertices();
+
+		std::cerr << "# v# " << verts_.size() << " f# " << faces_.size() << " unique v# " << uniqueVertexCorners_.size() << std::endl;
+	}
+
+	void Model::BuildUniqueVertices()
+	{
+		std::unordered_map<u64, u32> uniqueVertexIndexByKey;
+		uniqueVertexIndices_.clear();
+		uniqueVertexIndices_.reserve(faces_.size() * 3);
+		uniqueVertexCorners_.clear();
+
+		for (int faceIdx = 0; faceIdx < nfaces(); faceIdx++)
+		{
+			for (int vertexIndex = 0; vertexIndex < 3; vertexIndex++)
+			{
+				const u64 key = static_cast<u64>(static_cast<u32>(faces_[faceIdx][vertexIndex * 2])) << 32
+					| static_cast<u32>(faces_[faceIdx][vertexIndex * 2 + 1]);
+				const auto [it, inserted] = uniqueVertexIndexByKey.try_emplace(key, static_cast<u32>(uniqueVertexCorners_.size()));
+				if (inserted)
+					uniqueVertexCorners_.push_back({ faceIdx, vertexIndex });
+
+				uniqueVertexIndices_.push_back(it->second);
+			}
+		}
+
+		// normals are looked up by the position index, a model without one normal per position has none usable
+		const bool hasVertexNormals = !vnormals_.empty() && vnormals_.size() == verts_.size();
+
+		UniqueVertexStreams& streams = uniqueVertexStreams_;
+		streams = {};
+		for (const std::array<int, 2>& corner : uniqueVertexCorners_)
+		{
+			const Vec3f position = VertexForFace(corner[0], static_cast<u8>(corner[1]));
+			streams.positionX.push_back(position.x);
+			streams.positionY.push_back(position.y);
+			streams.positionZ.push_back(position.z);
+
+			if (hasVertexNormals)
+			{
+				const Vec3f normal = NormalForFaceAndVertex(corner[0], static_cast<u8>(corner[1]));
+				streams.normalX.push_back(normal.x);
+				streams.normalY.push_back(normal.y);
+				streams.normalZ.push_back(normal.z);
+			}
+
+			const Vec2f uv = UVForFaceAndVertex(corner[0], static_cast<u8>(corner[1]));
+			streams.u.push_back(uv.x);
+			streams.v.push_back(uv.y);
+		}
 	}
 
 	Vec3f Model::VertexForFace(int faceIdx, u8 vertexIndex) const
 	{
 		assert(vertexIndex <= 2);
 
-		return vert(face(faceIdx)[vertexIndex * 2]);
+		return vert(faces_[faceIdx][vertexIndex * 2]);
 	}
 
 	Vec3f Model::NormalForFaceAndVertex(int faceIdx, u8 vertexIndex) const
 	{
 		assert(vertexIndex <= 2);
 
-		return vnormal(face(faceIdx)[vertexIndex * 2]);
+		return vnormal(faces_[faceIdx][vertexIndex * 2]);
 	}
 
 	Vec2f Model::UVForFaceAndVertex(int faceIdx, u8 vertexIndex) const
 	{
 		assert(vertexIndex <= 2);
 
-		return uv(face(faceIdx)[vertexIndex * 2 + 1]);
+		return uv(faces_[faceIdx][vertexIndex * 2 + 1]);
+	}
+
+	int Model::VertexIndexForFace(int faceIdx, u8 vertexIndex) const
+	{
+		assert(vertexIndex <= 2);
+
+		return faces_[faceIdx][vertexIndex * 2];
 	}
 
 
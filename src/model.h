@@ -1,6 +1,7 @@
 #ifndef __MODEL_H__
 #define __MODEL_H__
 
+#include <array>
 #include <vector>
 #include "geometry.h"
 #include "types.h"
@@ -8,11 +9,29 @@
 namespace sor
 {
 	class Model {
+	public:
+		// Data of the unique vertices in structure of arrays, one array per component, for the vertex shaders that
+		// process them in batches. The normals are empty unless the model has exactly one normal per position.
+		struct UniqueVertexStreams
+		{
+			std::vector<float> positionX, positionY, positionZ;
+			std::vector<float> normalX, normalY, normalZ;
+			std::vector<float> u, v;
+		};
+
 	private:
 		std::vector<Vec3f> verts_;
 		std::vector<Vec3f> vnormals_;
 		std::vector<Vec2f> uvs_;
 		std::vector<std::vector<int> > faces_; // interleaved indices into verts_ and uvs_ array
+
+		// Unique combinations of a vertex and its uv, everything the vertex shader reads depends only on those. Every face
+		// corner has its index and every unique vertex keeps one of the corners it was made from to run the shader on.
+		std::vector<u32> uniqueVertexIndices_;
+		std::vector<std::array<int, 2>> uniqueVertexCorners_; // face index and vertex index within the face
+		UniqueVertexStreams uniqueVertexStreams_;
+
+		void BuildUniqueVertices();
 	public:
 		Model();
 		~Model();
@@ -28,6 +47,15 @@ namespace sor
 		Vec3f VertexForFace(int faceIdx, u8 vertexIndex) const;
 		Vec3f NormalForFaceAndVertex(int faceIdx, u8 vertexIndex) const;
 		Vec2f UVForFaceAndVertex(int faceIdx, u8 vertexIndex) const;
+		int VertexIndexForFace(int faceIdx, u8 vertexIndex) const;
+
+		int GetUniqueVertexCount() const { return static_cast<int>(uniqueVertexCorners_.size()); }
+		u32 GetUniqueVertexIndex(int faceIdx, u8 vertexIndex) const { return uniqueVertexIndices_[faceIdx * 3 + vertexIndex]; }
+		// indices of the unique vertices of all faces, three for every face
+		const std::vector<u32>& GetUniqueVertexIndices() const { return uniqueVertexIndices_; }
+		// a face corner the unique vertex is used by
+		const std::array<int, 2>& GetUniqueVertexCorner(u32 uniqueVertexIdx) const { return uniqueVertexCorners_[uniqueVertexIdx]; }
+		const UniqueVertexStreams& GetUniqueVertexStreams() const { return uniqueVertexStreams_; }
 	};
 
 }
@@ -0,0 +1,433 @@
+#include "pipeline.h"
+
+#include <algorithm>
+
+#include "Instrumentor.h"
+#include "thread_pool.h"
+
+namespace sor
+{
+	//--------------------------------------------------------------------------------------------------
+	void TiledRenderer::BeginFrame(const Vec2i& outputSize)
+	{
+		m_OutputSize = outputSize;
+		m_TileCount = { (outputSize.x + TILE_SIZE - 1) / TILE_SIZE, (outputSize.y + TILE_SIZE - 1) / TILE_SIZE };
+
+		// keep the allocations from the previous frame around
+		m_Triangles.clear();
+		m_VaryingData.clear();
+		m_TileBins.resize(m_TileCount.x * m_TileCount.y);
+		for (std::vector<u32>& bin : m_TileBins)
+			bin.clear();
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void TiledRenderer::SubmitTriangle(const Triangle& t, const IShaderBase& shader)
+	{
+		m_Triangles.push_back(t);
+		m_VaryingData.push_back(shader.GetTriangleVaryingData());
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void TiledRenderer::EndFrame(Texture& output, const IFragmentShader& fragmentShader)
+	{
+		{
+			PROFILE_SCOPE("TiledRenderer::Setup")
+			m_SetupBatch.Setup(m_Triangles, m_OutputSize, SORT_FRONT_TO_BACK);
+		}
+
+		{
+			PROFILE_SCOPE("TiledRenderer::Binning")
+			for (int setupIdx = 0; setupIdx < m_SetupBatch.GetCount(); setupIdx++)
+			{
+				const TriangleSetup& setup = m_SetupBatch.GetSetup(setupIdx);
+				for (int tileY = setup.bboxMin.y / TILE_SIZE; tileY <= setup.bboxMax.y / TILE_SIZE; tileY++)
+					for (int tileX = setup.bboxMin.x / TILE_SIZE; tileX <= setup.bboxMax.x / TILE_SIZE; tileX++)
+						m_TileBins[tileY * m_TileCount.x + tileX].push_back(static_cast<u32>(setupIdx));
+			}
+		}
+
+		PROFILE_SCOPE("TiledRenderer::Rasterization")
+		ThreadPool& threadPool = GetThreadPool();
+
+		m_Workers.resize(threadPool.GetWorkerCount());
+		for (WorkerContext& worker : m_Workers)
+			worker.fragmentShader = fragmentShader.Clone();
+
+		threadPool.ParallelFor(static_cast<int>(m_TileBins.size()), [this, &output](int tileIdx, int workerIdx)
+		{
+			DrawTile(tileIdx, m_Workers[workerIdx], output);
+		});
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void TiledRenderer::DrawTile(int tileIdx, WorkerContext& worker, Texture& output)
+	{
+		const std::vector<u32>& bin = m_TileBins[tileIdx];
+		if (bin.empty())
+			return;
+
+		const Vec2i tileOrigin{ (tileIdx % m_TileCount.x) * TILE_SIZE, (tileIdx / m_TileCount.x) * TILE_SIZE };
+
+		// start from what's already in the output so the pixels no triangle covers are written back unchanged
+		worker.color.Blit(output, -tileOrigin.x, -tileOrigin.y);
+		worker.depth.Clear();
+
+		for (u32 setupIdx : bin)
+		{
+			worker.fragmentShader->SetTriangleVaryingData(m_VaryingData[m_SetupBatch.GetTriangleIdx(setupIdx)]);
+			RasterizeTriangle(m_SetupBatch.GetSetup(setupIdx), worker.color, worker.depth, tileOrigin, *worker.fragmentShader);
+		}
+
+		output.Blit(worker.color, tileOrigin.x, tileOrigin.y);
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void SortLastRenderer::BeginFrame(const Vec2i& outputSize)
+	{
+		// the depth buffers have a fixed size
+		assert(outputSize.x == IMAGE_SIZE_DEFAULT_X && outputSize.y == IMAGE_SIZE_DEFAULT_Y);
+		m_OutputSize = outputSize;
+
+		// keep the allocations from the previous frame around
+		m_Triangles.clear();
+		m_VaryingData.clear();
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void SortLastRenderer::SubmitTriangle(const Triangle& t, const IShaderBase& shader)
+	{
+		m_Triangles.push_back(t);
+		m_VaryingData.push_back(shader.GetTriangleVaryingData());
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void SortLastRenderer::EndFrame(Texture& output, const IFragmentShader& fragmentShader)
+	{
+		{
+			PROFILE_SCOPE("SortLastRenderer::Setup")
+			m_SetupBatch.Setup(m_Triangles, m_OutputSize, SORT_FRONT_TO_BACK);
+		}
+
+		ThreadPool& threadPool = GetThreadPool();
+		const int sliceCount = std::min(threadPool.GetWorkerCount(), SORT_LAST_MAX_SLICE_COUNT);
+
+		// the slices and their buffers are kept from the previous frame, the lazy clear of the depth only resets
+		// what the slice drew last time
+		if (static_cast<int>(m_Slices.size()) != sliceCount)
+			m_Slices.resize(sliceCount);
+
+		m_CompositeMin = m_OutputSize;
+		m_CompositeMax = { -1, -1 };
+		const int setupCount = m_SetupBatch.GetCount();
+		for (int sliceIdx = 0; sliceIdx < sliceCount; sliceIdx++)
+		{
+			Slice& slice = m_Slices[sliceIdx];
+			slice.setupBegin = static_cast<int>(static_cast<i64>(setupCount) * sliceIdx / sliceCount);
+			slice.setupEnd = static_cast<int>(static_cast<i64>(setupCount) * (sliceIdx + 1) / sliceCount);
+
+			slice.min = m_OutputSize;
+			slice.max = { -1, -1 };
+			for (int setupIdx = slice.setupBegin; setupIdx < slice.setupEnd; setupIdx++)
+			{
+				const TriangleSetup& setup = m_SetupBatch.GetSetup(setupIdx);
+				slice.min = { std::min(slice.min.x, setup.bboxMin.x), std::min(slice.min.y, setup.bboxMin.y) };
+				slice.max = { std::max(slice.max.x, setup.bboxMax.x), std::max(slice.max.y, setup.bboxMax.y) };
+			}
+
+			m_CompositeMin = { std::min(m_CompositeMin.x, slice.min.x), std::min(m_CompositeMin.y, slice.min.y) };
+			m_CompositeMax = { std::max(m_CompositeMax.x, slice.max.x), std::max(m_CompositeMax.y, slice.max.y) };
+		}
+
+		m_WorkerShaders.resize(threadPool.GetWorkerCount());
+		for (std::unique_ptr<IFragmentShader>& workerShader : m_WorkerShaders)
+			workerShader = fragmentShader.Clone();
+
+		{
+			PROFILE_SCOPE("SortLastRenderer::Rasterization")
+			threadPool.ParallelFor(sliceCount, [this, &output](int sliceIdx, int workerIdx)
+			{
+				DrawSlice(m_Slices[sliceIdx], *m_WorkerShaders[workerIdx], output);
+			});
+		}
+
+		PROFILE_SCOPE("SortLastRenderer::Compositing")
+		if (m_CompositeMin.y > m_CompositeMax.y)
+			return;
+
+		threadPool.ParallelFor(m_CompositeMax.y - m_CompositeMin.y + 1, [this, &output](int rowIdx, int)
+		{
+			CompositeRow(m_CompositeMin.y + rowIdx, output);
+		});
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void SortLastRenderer::DrawSlice(Slice& slice, IFragmentShader& fragmentShader, const Texture& output)
+	{
+		slice.depth.Clear();
+		if (slice.min.x > slice.max.x)
+			return;
+
+		if (slice.color.GetWidth() != m_OutputSize.x || slice.color.GetHeight() != m_OutputSize.y)
+			slice.color = Texture{ m_OutputSize.x, m_OutputSize.y, output.GetTextureFormat() };
+
+		// Only the part the slice can draw to is composited, it starts from what's already in the output so the
+		// pixels no triangle covers keep it. Anything else is left from the previous frames.
+		for (int y = slice.min.y; y <= slice.max.y; y++)
+			slice.color.CopyPixels(output, slice.min.x, y, slice.max.x - slice.min.x + 1);
+
+		for (int setupIdx = slice.setupBegin; setupIdx < slice.setupEnd; setupIdx++)
+		{
+			fragmentShader.SetTriangleVaryingData(m_VaryingData[m_SetupBatch.GetTriangleIdx(setupIdx)]);
+			RasterizeTriangle(m_SetupBatch.GetSetup(setupIdx), slice.color, slice.depth, { 0, 0 }, fragmentShader);
+		}
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void SortLastRenderer::CompositeRow(int y, Texture& output)
+	{
+		// slices that drew something in the row are found once, in the slice order
+		std::array<const Slice*, SORT_LAST_MAX_SLICE_COUNT> rowSlices;
+		std::array<const float*, SORT_LAST_MAX_SLICE_COUNT> rowDepths;
+		int rowSliceCount = 0;
+		for (Slice& slice : m_Slices)
+		{
+			if (slice.min.y > y || slice.max.y < y)
+				continue;
+
+			rowSlices[rowSliceCount] = &slice;
+			rowDepths[rowSliceCount] = slice.depth.GetFloatData() + y * slice.depth.GetWidth();
+			rowSliceCount++;
+		}
+
+		// runs of pixels won by the same slice are copied at once
+		const Slice* runSlice = nullptr;
+		int runStart = 0;
+		for (int x = m_CompositeMin.x; x <= m_CompositeMax.x + 1; x++)
+		{
+			const Slice* winner = nullptr;
+			if (x <= m_CompositeMax.x)
+			{
+				float nearestDepth = std::numeric_limits<float>::infinity();
+				for (int i = 0; i < rowSliceCount; i++)
+				{
+					// strictly closer so the earlier slice wins the ties
+					if (x >= rowSlices[i]->min.x && x <= rowSlices[i]->max.x && rowDepths[i][x] < nearestDepth)
+					{
+						nearestDepth = rowDepths[i][x];
+						winner = rowSlices[i];
+					}
+				}
+			}
+
+			if (winner == runSlice)
+				continue;
+
+			if (runSlice)
+				output.CopyPixels(runSlice->color, runStart, y, x - runStart);
+
+			runSlice = winner;
+			runStart = x;
+		}
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	bool VisibilityBufferRenderer::TriangleIdWriter::fragment()
+	{
+		assert(false && "triangle ids are only written in spans");
+		return false;
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	bool VisibilityBufferRenderer::TriangleIdWriter::ShadeSpan(const FragmentSpan& span, Texture& /*colorTarget*/)
+	{
+		const TriangleSetup& setup = *m_pSetup;
+		u32* triangleIds = m_pTriangleIds + span.y * m_Width;
+		float depth = span.depth;
+		float* depthValue = span.depthRow;
+		bool depthWritten = false;
+
+		// the visibility is always rasterized with the target at the origin, span coordinates are pixel coordinates
+		std::array<i64, 3> edgeValues{ setup.edges[0].Evaluate(span.xStart, span.y), setup.edges[1].Evaluate(span.xStart, span.y),
+			setup.edges[2].Evaluate(span.xStart, span.y) };
+
+		for (int x = span.xStart; x < span.xEnd; x++)
+		{
+			if (m_DepthPerPixel)
+			{
+				depth = setup.vertsZ.dot(Vec3f{
+					static_cast<float>(edgeValues[0]) * setup.oneOverDoubleArea,
+					static_cast<float>(edgeValues[1]) * setup.oneOverDoubleArea,
+					static_cast<float>(edgeValues[2]) * setup.oneOverDoubleArea });
+			}
+
+			if (PassesDepthTest(span.depthCompare, depth, *depthValue))
+			{
+				*depthValue = depth;
+				triangleIds[x] = m_TriangleId;
+				depthWritten = true;
+			}
+
+			depth += span.depthStep;
+			depthValue++;
+			for (int i = 0; i < 3; i++)
+				edgeValues[i] += setup.edges[i].a;
+		}
+
+		return depthWritten;
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void VisibilityBufferRenderer::BeginFrame(const Vec2i& outputSize)
+	{
+		// the depth buffer has a fixed size
+		assert(outputSize.x == IMAGE_SIZE_DEFAULT_X && outputSize.y == IMAGE_SIZE_DEFAULT_Y);
+		m_OutputSize = outputSize;
+
+		// keep the allocations from the previous frame around
+		m_Triangles.clear();
+		m_VaryingData.clear();
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void VisibilityBufferRenderer::SubmitTriangle(const Triangle& t, const IShaderBase& shader)
+	{
+		m_Triangles.push_back(t);
+		m_VaryingData.push_back(shader.GetTriangleVaryingData());
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void VisibilityBufferRenderer::EndFrame(Texture& output, const IFragmentShader& fragmentShader)
+	{
+		assert(fragmentShader.GetDepthTestStage() == EDepthTestStage::EARLY);
+
+		{
+			PROFILE_SCOPE("VisibilityBufferRenderer::Setup")
+			m_SetupBatch.Setup(m_Triangles, m_OutputSize, SORT_FRONT_TO_BACK);
+		}
+
+		{
+			PROFILE_SCOPE("VisibilityBufferRenderer::Visibility")
+			m_TriangleIds.assign(static_cast<size_t>(m_OutputSize.x) * m_OutputSize.y, INVALID_TRIANGLE_ID);
+			m_Depth.Clear();
+
+			m_TriangleIdWriter.m_pTriangleIds = m_TriangleIds.data();
+			m_TriangleIdWriter.m_Width = m_OutputSize.x;
+			for (int setupIdx = 0; setupIdx < m_SetupBatch.GetCount(); setupIdx++)
+			{
+				const TriangleSetup& setup = m_SetupBatch.GetSetup(setupIdx);
+				m_TriangleIdWriter.m_TriangleId = static_cast<u32>(setupIdx);
+				m_TriangleIdWriter.m_pSetup = &setup;
+				m_TriangleIdWriter.m_DepthPerPixel = GetRasterPath(setup, fragmentShader.GetFlags(), m_Depth) != ERasterPath::SPANS;
+				RasterizeTriangle(setup, output, m_Depth, { 0, 0 }, m_TriangleIdWriter);
+			}
+		}
+
+		PROFILE_SCOPE("VisibilityBufferRenderer::Shading")
+		ThreadPool& threadPool = GetThreadPool();
+
+		m_WorkerShaders.resize(threadPool.GetWorkerCount());
+		for (std::unique_ptr<IFragmentShader>& workerShader : m_WorkerShaders)
+			workerShader = fragmentShader.Clone();
+
+		threadPool.ParallelFor(m_OutputSize.y, [this, &output](int y, int workerIdx)
+		{
+			ShadeRow(y, *m_WorkerShaders[workerIdx], output);
+		});
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void VisibilityBufferRenderer::ShadeRow(int y, IFragmentShader& fragmentShader, Texture& output) const
+	{
+		const u32* triangleIds = m_TriangleIds.data() + y * m_OutputSize.x;
+		u32 currentTriangleId = INVALID_TRIANGLE_ID;
+		const bool usesDerivatives = (fragmentShader.GetFlags() & EFragmentShaderFlags::USES_DERIVATIVES) != EFragmentShaderFlags::NONE;
+
+		for (int x = 0; x < m_OutputSize.x; x++)
+		{
+			const u32 triangleId = triangleIds[x];
+			if (triangleId == INVALID_TRIANGLE_ID)
+				continue;
+
+			const TriangleSetup& setup = m_SetupBatch.GetSetup(static_cast<int>(triangleId));
+			if (triangleId != currentTriangleId)
+			{
+				fragmentShader.SetTriangleVaryingData(m_VaryingData[m_SetupBatch.GetTriangleIdx(static_cast<int>(triangleId))]);
+				if (usesDerivatives)
+					SetBarycentricDerivatives(setup, fragmentShader);
+				currentTriangleId = triangleId;
+			}
+
+			// computed the same way as by the rasterizer kernels
+			const Vec3f barycentricCoordinates{
+				static_cast<float>(setup.edges[0].Evaluate(x, y)) * setup.oneOverDoubleArea,
+				static_cast<float>(setup.edges[1].Evaluate(x, y)) * setup.oneOverDoubleArea,
+				static_cast<float>(setup.edges[2].Evaluate(x, y)) * setup.oneOverDoubleArea };
+
+			fragmentShader.SetFragmentDepth(setup.vertsZ.dot(barycentricCoordinates));
+			fragmentShader.SetInterpolationData({ .barycentricCoordinates = barycentricCoordinates, .verticesW = setup.vertsW,
+				.interpolatedOneOverW = setup.vertsOneOverW.dot(barycentricCoordinates) });
+			if (fragmentShader.fragment())
+				output.SetPixelUnchecked(x, y, TGAColor::FromVec4(fragmentShader.GetFinalColor()));
+		}
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void WireframeRenderer::Build(const Model& model)
+	{
+		// both vertex indices of every face edge in one key, the smaller one in the upper bits, so the same edge of
+		// neighbouring faces ends up next to its copies after sorting
+		std::vector<u64> edgeKeys;
+		edgeKeys.reserve(static_cast<size_t>(model.nfaces()) * 3);
+		for (int faceIdx = 0; faceIdx < model.nfaces(); faceIdx++)
+		{
+			const std::vector<int> face = model.face(faceIdx);
+			for (int i = 0; i < 3; i++)
+			{
+				const u32 v0 = static_cast<u32>(face[i * 2]);
+				const u32 v1 = static_cast<u32>(face[(i + 1) % 3 * 2]);
+				edgeKeys.push_back(static_cast<u64>(std::min(v0, v1)) << 32 | std::max(v0, v1));
+			}
+		}
+
+		std::sort(edgeKeys.begin(), edgeKeys.end());
+		edgeKeys.erase(std::unique(edgeKeys.begin(), edgeKeys.end()), edgeKeys.end());
+
+		m_Edges.clear();
+		m_Edges.reserve(edgeKeys.size());
+		for (const u64 key : edgeKeys)
+			m_Edges.push_back({ static_cast<int>(key >> 32), static_cast<int>(key & 0xffffffffu) });
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void WireframeRenderer::Draw(const Model& model, const Mat4& vertexToScreen, Texture& output, TGAColor color,
+		const ZBufferBase* depthBuffer, float depthBias)
+	{
+		PROFILE_SCOPE("WireframeRenderer::Draw")
+
+		m_Vertices.resize(model.nverts());
+		for (int i = 0; i < model.nverts(); i++)
+			m_Vertices[i] = vertexToScreen * model.vert(i).ToPoint();
+
+		m_Segments.clear();
+		for (const std::array<int, 2>& edge : m_Edges)
+		{
+			Vec4f start = m_Vertices[edge[0]];
+			Vec4f end = m_Vertices[edge[1]];
+			const float startDistance = start.w() - NEAR_PLANE;
+			const float endDistance = end.w() - NEAR_PLANE;
+			if (startDistance < 0.f && endDistance < 0.f)
+				continue;
+
+			// the part behind the near plane would flip to the other side of the screen after the division
+			if (startDistance < 0.f)
+				start = start * (endDistance / (endDistance - startDistance)) + end * (-startDistance / (endDistance - startDistance));
+			else if (endDistance < 0.f)
+				end = end * (startDistance / (startDistance - endDistance)) + start * (-endDistance / (startDistance - endDistance));
+
+			m_Segments.push_back({ start.FromHomogeneous(), end.FromHomogeneous(), color });
+		}
+
+		DrawLines(m_Segments, output, depthBuffer, depthBias);
+	}
+}
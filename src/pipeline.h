@@ -1,9 +1,189 @@
 #pragma once
 
+#include <limits>
+#include <memory>
+#include <vector>
+
 #include "model.h"
 #include "constants.h"
+#include "line_drawing.h"
+#include "triangle_drawing.h"
+#include "triangle_setup.h"
 
 namespace sor
 {
+	// size of the square screen tile the tiled renderer bins triangles into
+	constexpr int TILE_SIZE = 64;
+	static_assert(TILE_SIZE % RASTER_SPAN_MAX_LENGTH == 0, "spans have to be cut at tile borders for tiles to match the whole screen rendering");
+
+	class ZBufferFloatTile : public ZBuffer<float, TILE_SIZE, TILE_SIZE, 1000.f>
+	{
+
+	};
+
+	//--------------------------------------------------------------------------------------------------
+	// Sort-middle renderer. Triangles are set up and binned into screen tiles in the order they are submitted (or front
+	// to back with SORT_FRONT_TO_BACK), then the tiles are rasterized and shaded in parallel into tile local color and
+	// depth buffers which are small enough to stay in L2 cache and the color is written back to the output once per
+	// tile. Every pixel still sees its triangles in that order so the result is the same as drawing them one by one on
+	// a single thread.
+	// The depth lives only in the tile buffers, it's not written back to any full screen z-buffer.
+	class TiledRenderer
+	{
+	public:
+		void BeginFrame(const Vec2i& outputSize);
+
+		// stores the triangle together with the varying data the vertex shader has written for it
+		void SubmitTriangle(const Triangle& t, const IShaderBase& shader);
+
+		// sets up all triangles, bins them into the tiles they overlap and then rasterizes and shades all tiles that have
+		// some triangles in them, fragment shader gets cloned for every worker
+		void EndFrame(Texture& output, const IFragmentShader& fragmentShader);
+
+	private:
+		struct WorkerContext
+		{
+			std::unique_ptr<IFragmentShader> fragmentShader;
+			Texture color{ TILE_SIZE, TILE_SIZE, Texture::ETextureFormat::RGB };
+			ZBufferFloatTile depth;
+		};
+
+		void DrawTile(int tileIdx, WorkerContext& worker, Texture& output);
+
+		Vec2i m_OutputSize;
+		Vec2i m_TileCount;
+
+		std::vector<Triangle> m_Triangles;
+		std::vector<IShaderBase::TriangleVaryingData> m_VaryingData;
+		TriangleSetupBatch m_SetupBatch;
+		std::vector<std::vector<u32>> m_TileBins;	// indices into m_SetupBatch in its order
+		std::vector<WorkerContext> m_Workers;
+	};
+
+	// the sort-last renderer uses one slice per worker up to this many, every slice has its own full screen buffers
+	constexpr int SORT_LAST_MAX_SLICE_COUNT = 64;
+
+	//--------------------------------------------------------------------------------------------------
+	// Sort-last renderer. The triangles are split into contiguous slices (in the draw order), one per worker, and
+	// every slice is rasterized and shaded on its own into a private full screen color and depth buffer.
+	// The slices are then depth composited in parallel, row by row. The split doesn't depend on where the triangles
+	// end up on the screen so the load stays balanced for models covering only a small part of it.
+	// Depth ties are won by the earlier slice, the same way the earlier triangle wins them with a single buffer, so the
+	// result matches drawing the triangles one by one. The exception are fragments that are discarded after the
+	// early depth test wrote their depth, those show what was in the output before the frame instead of what's
+	// behind them in the earlier slices. Like in the tiled renderer, the depth isn't written to any shared z-buffer.
+	class SortLastRenderer
+	{
+	public:
+		void BeginFrame(const Vec2i& outputSize);
+
+		// stores the triangle together with the varying data the vertex shader has written for it
+		void SubmitTriangle(const Triangle& t, const IShaderBase& shader);
+
+		// sets up all triangles, draws the slices in parallel and composites them into the output, fragment shader gets
+		// cloned for every worker
+		void EndFrame(Texture& output, const IFragmentShader& fragmentShader);
+
+	private:
+		struct Slice
+		{
+			int setupBegin{ 0 };		// range of m_SetupBatch
+			int setupEnd{ 0 };
+			Vec2i min;					// union of the bounding boxes of the triangles, inclusive
+			Vec2i max;
+			Texture color;
+			ZBufferFloatDefault depth;
+		};
+
+		void DrawSlice(Slice& slice, IFragmentShader& fragmentShader, const Texture& output);
+		void CompositeRow(int y, Texture& output);
+
+		Vec2i m_OutputSize;
+		Vec2i m_CompositeMin;
+		Vec2i m_CompositeMax;
+
+		std::vector<Triangle> m_Triangles;
+		std::vector<IShaderBase::TriangleVaryingData> m_VaryingData;
+		TriangleSetupBatch m_SetupBatch;
+		std::vector<Slice> m_Slices;
+		std::vector<std::unique_ptr<IFragmentShader>> m_WorkerShaders;
+	};
+
+	//--------------------------------------------------------------------------------------------------
+	// Deferred shading through a visibility buffer. First all triangles are rasterized in the draw order but only
+	// the depth and the id of the triangle are written for every pixel. Then every visible pixel is shaded exactly once,
+	// rows are shaded in parallel, with the barycentric coordinates rebuilt from the edge functions of its triangle.
+	// Overdraw costs only the depth test so the cost of an expensive fragment shader follows the number of pixels on the
+	// screen, not the depth complexity. The visibility can't depend on fragment() so the fragment shader has to be one
+	// with the early depth test.
+	class VisibilityBufferRenderer
+	{
+	public:
+		// Pixels no triangle covers have this id. There is no instancing so the id is the index of the set up triangle,
+		// that tells both the face (Triangle::index) and which part of it in case it was clipped.
+		static constexpr u32 INVALID_TRIANGLE_ID = std::numeric_limits<u32>::max();
+
+		void BeginFrame(const Vec2i& outputSize);
+
+		// stores the triangle together with the varying data the vertex shader has written for it
+		void SubmitTriangle(const Triangle& t, const IShaderBase& shader);
+
+		// sets up all triangles, rasterizes the visibility buffer and shades it, fragment shader gets cloned for every worker
+		void EndFrame(Texture& output, const IFragmentShader& fragmentShader);
+
+	private:
+		// Writes triangle ids instead of shading, the rasterizer hands it whole rows of the triangle as spans. The depth
+		// is interpolated the way the shading shader would have it rasterized without the visibility buffer, so every
+		// pixel ends up with the same triangle as in the immediate mode, ties of equal depth included.
+		class TriangleIdWriter : public IFragmentShader
+		{
+		public:
+			bool fragment() override;
+			std::unique_ptr<IFragmentShader> Clone() const override { return std::make_unique<TriangleIdWriter>(*this); }
+			bool ShadeSpan(const FragmentSpan& span, Texture& colorTarget) override;
+			EFragmentShaderFlags GetFlags() const override { return EFragmentShaderFlags::SPANS_ONLY; }
+
+			u32* m_pTriangleIds{ nullptr };
+			int m_Width{ 0 };
+			u32 m_TriangleId{ INVALID_TRIANGLE_ID };
+			const TriangleSetup* m_pSetup{ nullptr };
+			bool m_DepthPerPixel{ false };	// from the edge values of every pixel instead of stepped along the span
+		};
+
+		void ShadeRow(int y, IFragmentShader& fragmentShader, Texture& output) const;
+
+		Vec2i m_OutputSize;
+
+		std::vector<Triangle> m_Triangles;
+		std::vector<IShaderBase::TriangleVaryingData> m_VaryingData;
+		TriangleSetupBatch m_SetupBatch;
+		std::vector<u32> m_TriangleIds;		// per pixel, row after row
+		ZBufferFloatDefault m_Depth;
+		TriangleIdWriter m_TriangleIdWriter;
+		std::vector<std::unique_ptr<IFragmentShader>> m_WorkerShaders;
+	};
+
+	//--------------------------------------------------------------------------------------------------
+	// Wireframe of a whole model with every edge drawn exactly once. The unique edges are collected from the faces once
+	// when the model is loaded, neighbouring faces share them so there's about half as many as there are face edges.
+	// Every frame each vertex is transformed and divided by w only once, no matter how many edges use it, and all edges
+	// go through the batched line drawing.
+	class WireframeRenderer
+	{
+	public:
+		void Build(const Model& model);
+
+		// Transforms the vertices by vertexToScreen (the whole transformation up to and including the viewport), clips the
+		// edges by the near plane and draws them. With a depth buffer (from a depth prepass) only the parts of the edges
+		// in front of the surfaces are drawn, depthBias keeps the edges of the visible surfaces themselves.
+		void Draw(const Model& model, const Mat4& vertexToScreen, Texture& output, TGAColor color,
+			const ZBufferBase* depthBuffer = nullptr, float depthBias = 0.f);
+
+		int GetEdgeCount() const { return static_cast<int>(m_Edges.size()); }
 
-}
\ No newline at end of file
+	private:
+		std::vector<std::array<int, 2>> m_Edges;	// vertex indices, the smaller one first
+		std::vector<Vec4f> m_Vertices;				// transformed vertices of the current frame
+		std::vector<LineSegment> m_Segments;
+	};
+}
@@ -0,0 +1,85 @@
+#include "radix_sort.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "thread_pool.h"
+
+namespace sor
+{
+	//--------------------------------------------------------------------------------------------------
+	void RadixSorter::Sort(std::vector<u32>& keys, std::vector<u32>& values)
+	{
+		assert(keys.size() == values.size());
+
+		ThreadPool& threadPool = GetThreadPool();
+		const int count = static_cast<int>(keys.size());
+		const int chunkCount = std::clamp(count / MIN_CHUNK_SIZE, 1, threadPool.GetWorkerCount());
+
+		m_KeysScratch.resize(count);
+		m_ValuesScratch.resize(count);
+		m_ChunkOffsets.resize(chunkCount);
+
+		const auto getChunkBegin = [count, chunkCount](int chunkIdx)
+		{
+			return static_cast<int>(static_cast<i64>(count) * chunkIdx / chunkCount);
+		};
+
+		// a single chunk isn't worth waking up the pool for
+		const auto forEachChunk = [&threadPool, chunkCount](const auto& func)
+		{
+			if (chunkCount == 1)
+				func(0);
+			else
+				threadPool.ParallelFor(chunkCount, [&func](int chunkIdx, int) { func(chunkIdx); });
+		};
+
+		for (int shift = 0; shift < 32; shift += DIGIT_BITS)
+		{
+			forEachChunk([this, &keys, &getChunkBegin, shift](int chunkIdx)
+			{
+				Histogram& histogram = m_ChunkOffsets[chunkIdx];
+				histogram.fill(0);
+				for (int i = getChunkBegin(chunkIdx); i < getChunkBegin(chunkIdx + 1); i++)
+					histogram[(keys[i] >> shift) & (BUCKET_COUNT - 1)]++;
+			});
+
+			// Exclusive prefix sum over the buckets and within every bucket over the chunks in their order, which keeps
+			// the sort stable.
+			u32 offset = 0;
+			bool allInOneBucket = false;
+			for (int bucket = 0; bucket < BUCKET_COUNT; bucket++)
+			{
+				u32 bucketCount = 0;
+				for (Histogram& chunkOffsets : m_ChunkOffsets)
+				{
+					const u32 chunkBucketCount = chunkOffsets[bucket];
+					chunkOffsets[bucket] = offset;
+					offset += chunkBucketCount;
+					bucketCount += chunkBucketCount;
+				}
+
+				if (bucketCount == static_cast<u32>(count))
+					allInOneBucket = true;
+			}
+
+			// the pass wouldn't change the order
+			if (allInOneBucket)
+				continue;
+
+			forEachChunk([this, &keys, &values, &getChunkBegin, shift](int chunkIdx)
+			{
+				Histogram& offsets = m_ChunkOffsets[chunkIdx];
+				for (int i = getChunkBegin(chunkIdx); i < getChunkBegin(chunkIdx + 1); i++)
+				{
+					const u32 target = offsets[(keys[i] >> shift) & (BUCKET_COUNT - 1)]++;
+					m_KeysScratch[target] = keys[i];
+					m_ValuesScratch[target] = values[i];
+				}
+			});
+
+			keys.swap(m_KeysScratch);
+			values.swap(m_ValuesScratch);
+		}
+	}
+}
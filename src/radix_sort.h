@@ -0,0 +1,43 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <vector>
+
+#include "types.h"
+
+namespace sor
+{
+	// Unsigned key that sorts the same way as the float does. The sign bit is set for positive floats so they go after
+	// the negative ones, which are flipped whole so that the larger magnitude goes first.
+	inline u32 FloatToSortKey(float value)
+	{
+		const u32 bits = std::bit_cast<u32>(value);
+		return (bits & 0x80000000u) != 0 ? ~bits : bits | 0x80000000u;
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	// Parallel least significant digit radix sort of values by 32 bit keys. Every pass builds histograms of contiguous
+	// chunks in parallel and then scatters the chunks in parallel. It's stable, values with the same key stay in the
+	// order they were given in, so the result doesn't depend on the number of workers. Passes in which all keys have
+	// the same digit are skipped. The scratch buffers are kept between calls so sorting about the same amount of data
+	// every frame doesn't allocate.
+	class RadixSorter
+	{
+	public:
+		// sorts both arrays by the keys in ascending order, they have to be of the same size
+		void Sort(std::vector<u32>& keys, std::vector<u32>& values);
+
+	private:
+		static constexpr int DIGIT_BITS = 8;
+		static constexpr int BUCKET_COUNT = 1 << DIGIT_BITS;
+		// smaller chunks aren't worth handing to another worker
+		static constexpr int MIN_CHUNK_SIZE = 4096;
+
+		using Histogram = std::array<u32, BUCKET_COUNT>;
+
+		std::vector<u32> m_KeysScratch;
+		std::vector<u32> m_ValuesScratch;
+		std::vector<Histogram> m_ChunkOffsets;	// histogram of every chunk, then where its values of every bucket go
+	};
+}
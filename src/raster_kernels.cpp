@@ -0,0 +1,437 @@
+#include "raster_kernels.h"
+
+#include <bit>
+#include <cstring>
+#include <limits>
+
+#include "constants.h"
+
+namespace sor
+{
+	namespace
+	{
+		void ShadeFragment(int x, int y, const Vec3f& barycentricCoordinates, float oneOverW_interpolated, float depth,
+			const TriangleSetup& setup, Texture& colorTarget, IFragmentShader& fragmentShader)
+		{
+			fragmentShader.SetFragmentDepth(depth);
+			fragmentShader.SetInterpolationData({ .barycentricCoordinates = barycentricCoordinates, .verticesW = setup.vertsW,
+				.interpolatedOneOverW = oneOverW_interpolated });
+			if (!fragmentShader.fragment())
+				return;
+
+			colorTarget.SetPixelUnchecked(x, y, TGAColor::FromVec4(fragmentShader.GetFinalColor()));
+		}
+
+		// For shaders that discard fragments or write depth, the depth can't be written (or even tested) before fragment().
+		// Returns whether the depth was written.
+		bool ShadeFragment_LateDepth(int x, int y, const Vec3f& barycentricCoordinates, float oneOverW_interpolated, float depth,
+			EDepthTestStage depthTestStage, const TriangleSetup& setup, Texture& colorTarget, ZBufferBase& depthTarget,
+			IFragmentShader& fragmentShader)
+		{
+			if (depthTestStage == EDepthTestStage::EARLY_TEST_LATE_WRITE && !depthTarget.Test(x, y, depth))
+				return false;
+
+			fragmentShader.SetFragmentDepth(depth);
+			fragmentShader.SetInterpolationData({ .barycentricCoordinates = barycentricCoordinates, .verticesW = setup.vertsW,
+				.interpolatedOneOverW = oneOverW_interpolated });
+			if (!fragmentShader.fragment())
+				return false;
+
+			if (depthTestStage == EDepthTestStage::LATE)
+			{
+				if (!depthTarget.TestAndWrite(x, y, fragmentShader.GetFragmentDepth()))
+					return false;
+			}
+			else
+			{
+				depthTarget.Write(x, y, depth);
+			}
+
+			colorTarget.SetPixelUnchecked(x, y, TGAColor::FromVec4(fragmentShader.GetFinalColor()));
+			return true;
+		}
+
+		bool IsDepthOnly(const IFragmentShader& fragmentShader)
+		{
+			return (fragmentShader.GetFlags() & EFragmentShaderFlags::DEPTH_ONLY) != EFragmentShaderFlags::NONE;
+		}
+
+		// tests the depth and shades the pixel in the order the depth test stage needs, returns whether the depth was written
+		bool ShadePixel(int x, int y, const Vec3f& barycentricCoordinates, EDepthTestStage depthTestStage, bool depthOnly,
+			const TriangleSetup& setup, Texture& colorTarget, ZBufferBase& depthTarget, IFragmentShader& fragmentShader)
+		{
+			const float fragDepth = setup.vertsZ.dot(barycentricCoordinates);
+			if (depthOnly)
+				return depthTarget.TestAndWrite(x, y, fragDepth);
+
+			const float oneOverW_interpolated = setup.vertsOneOverW.dot(barycentricCoordinates);
+			if (depthTestStage != EDepthTestStage::EARLY)
+			{
+				return ShadeFragment_LateDepth(x, y, barycentricCoordinates, oneOverW_interpolated, fragDepth, depthTestStage, setup,
+					colorTarget, depthTarget, fragmentShader);
+			}
+
+			if (!depthTarget.TestAndWrite(x, y, fragDepth))
+				return false;
+
+			ShadeFragment(x, y, barycentricCoordinates, oneOverW_interpolated, fragDepth, setup, colorTarget, fragmentShader);
+			return true;
+		}
+
+		// Coverage of the full SMALL_TRIANGLE_MAX_SIZE x SMALL_TRIANGLE_MAX_SIZE footprint, bit of pixel (x, y) is
+		// y * SMALL_TRIANGLE_MAX_SIZE + x. Pixels outside of the footprint size aren't masked out.
+		u32 GetFootprintCoverage_Scalar(const TriangleSetup& setup, const RasterFootprint& footprint)
+		{
+			u32 coverage = 0;
+			for (int y = 0; y < SMALL_TRIANGLE_MAX_SIZE; y++)
+			{
+				for (int x = 0; x < SMALL_TRIANGLE_MAX_SIZE; x++)
+				{
+					i64 edgeValuesOr = 0;
+					for (int i = 0; i < 3; i++)
+						edgeValuesOr |= footprint.edgeValues[i] + setup.edges[i].a * x + setup.edges[i].b * y;
+
+					if (edgeValuesOr >= 0)
+						coverage |= BIT_FLAG(y * SMALL_TRIANGLE_MAX_SIZE + x);
+				}
+			}
+
+			return coverage;
+		}
+
+#if SOR_SIMD_X86
+		static_assert(SMALL_TRIANGLE_MAX_SIZE == 4, "SIMD footprint coverage assumes 4 pixels wide rows");
+
+		// Edge values have to fit in 32 bits, one row per register. The rows are then packed with signed saturation,
+		// which keeps the signs, into one register of 16 bytes so a single movemask gives the whole footprint.
+		SOR_TARGET_SSE2 u32 GetFootprintCoverage_SSE2(const TriangleSetup& setup, const RasterFootprint& footprint)
+		{
+			__m128i rowsOr[SMALL_TRIANGLE_MAX_SIZE]{ _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+			for (int i = 0; i < 3; i++)
+			{
+				const i64 value = footprint.edgeValues[i];
+				const i64 a = setup.edges[i].a;
+				// the values in between the corners fit as well so the rows can be stepped with 32 bit adds
+				__m128i row = _mm_setr_epi32(static_cast<i32>(value), static_cast<i32>(value + a), static_cast<i32>(value + 2 * a),
+					static_cast<i32>(value + 3 * a));
+				const __m128i stepY = _mm_set1_epi32(static_cast<i32>(setup.edges[i].b));
+
+				rowsOr[0] = _mm_or_si128(rowsOr[0], row);
+				row = _mm_add_epi32(row, stepY);
+				rowsOr[1] = _mm_or_si128(rowsOr[1], row);
+				row = _mm_add_epi32(row, stepY);
+				rowsOr[2] = _mm_or_si128(rowsOr[2], row);
+				row = _mm_add_epi32(row, stepY);
+				rowsOr[3] = _mm_or_si128(rowsOr[3], row);
+			}
+
+			const __m128i footprintOr = _mm_packs_epi16(_mm_packs_epi32(rowsOr[0], rowsOr[1]), _mm_packs_epi32(rowsOr[2], rowsOr[3]));
+			return ~static_cast<u32>(_mm_movemask_epi8(footprintOr)) & 0xFFFF;
+		}
+
+		// edge values have to fit in 32 bits, two rows per register
+		SOR_TARGET_AVX2 u32 GetFootprintCoverage_AVX2(const TriangleSetup& setup, const RasterFootprint& footprint)
+		{
+			u32 uncovered = 0;
+			for (int y = 0; y < SMALL_TRIANGLE_MAX_SIZE; y += 2)
+			{
+				__m256i edgeValuesOr = _mm256_setzero_si256();
+				for (int i = 0; i < 3; i++)
+				{
+					const i32 a = static_cast<i32>(setup.edges[i].a);
+					const i32 b = static_cast<i32>(setup.edges[i].b);
+					const i32 rowStart = static_cast<i32>(footprint.edgeValues[i] + setup.edges[i].b * y);
+					edgeValuesOr = _mm256_or_si256(edgeValuesOr, _mm256_setr_epi32(
+						rowStart, rowStart + a, rowStart + 2 * a, rowStart + 3 * a,
+						rowStart + b, rowStart + b + a, rowStart + b + 2 * a, rowStart + b + 3 * a));
+				}
+
+				uncovered |= static_cast<u32>(_mm256_movemask_ps(_mm256_castsi256_ps(edgeValuesOr))) << (y * SMALL_TRIANGLE_MAX_SIZE);
+			}
+
+			return ~uncovered & 0xFFFF;
+		}
+#endif
+
+		// runs the fragment shader for every pixel of the row which has its bit set in passedMask,
+		// the arrays hold values for every pixel of the row
+		void ShadePassedPixels(const TriangleSetup& setup, const RasterRow& row, u32 passedMask, const float* bary0, const float* bary1,
+			const float* bary2, const float* oneOverW, const float* depth, Texture& colorTarget, IFragmentShader& fragmentShader)
+		{
+			while (passedMask != 0)
+			{
+				const int pixelIdx = std::countr_zero(passedMask);
+				passedMask &= passedMask - 1;
+
+				ShadeFragment(row.targetPos.x + pixelIdx, row.targetPos.y, Vec3f{ bary0[pixelIdx], bary1[pixelIdx], bary2[pixelIdx] },
+					oneOverW[pixelIdx], depth[pixelIdx], setup, colorTarget, fragmentShader);
+			}
+		}
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void RasterizeRow_Scalar(const TriangleSetup& setup, const RasterRow& row, Texture& colorTarget, ZBufferBase& depthTarget,
+		IFragmentShader& fragmentShader)
+	{
+		const EDepthTestStage depthTestStage = fragmentShader.GetDepthTestStage();
+		const bool depthOnly = IsDepthOnly(fragmentShader);
+
+		std::array<i64, 3> edgeValues = row.edgeValues;
+		for (int x = row.targetPos.x; x < row.targetPos.x + row.width; x++)
+		{
+			// all three are non-negative exactly when the sign bit of their OR isn't set
+			if (row.fullyCovered || (edgeValues[0] | edgeValues[1] | edgeValues[2]) >= 0)
+			{
+				const Vec3f barycentricCoordinates{
+					static_cast<float>(edgeValues[0]) * setup.oneOverDoubleArea,
+					static_cast<float>(edgeValues[1]) * setup.oneOverDoubleArea,
+					static_cast<float>(edgeValues[2]) * setup.oneOverDoubleArea };
+
+				const float fragDepth = setup.vertsZ.dot(barycentricCoordinates);
+				const float oneOverW_interpolated = setup.vertsOneOverW.dot(barycentricCoordinates);
+				if (depthOnly)
+				{
+					depthTarget.TestAndWrite(x, row.targetPos.y, fragDepth);
+				}
+				else if (depthTestStage != EDepthTestStage::EARLY)
+				{
+					ShadeFragment_LateDepth(x, row.targetPos.y, barycentricCoordinates, oneOverW_interpolated, fragDepth, depthTestStage,
+						setup, colorTarget, depthTarget, fragmentShader);
+				}
+				else if (depthTarget.TestAndWrite(x, row.targetPos.y, fragDepth))
+				{
+					ShadeFragment(x, row.targetPos.y, barycentricCoordinates, oneOverW_interpolated, fragDepth, setup, colorTarget,
+						fragmentShader);
+				}
+			}
+
+			for (int i = 0; i < 3; i++)
+				edgeValues[i] += setup.edges[i].a;
+		}
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	SOR_TARGET_SSE2 void RasterizeRow_SSE2(const TriangleSetup& setup, const RasterRow& row, Texture& colorTarget, ZBufferBase& depthTarget,
+		IFragmentShader& fragmentShader)
+	{
+#if SOR_SIMD_X86
+		// SSE2 has no masked loads and stores so the depth of the row goes through a local copy
+		float* depthRow = depthTarget.GetFloatData() + row.targetPos.y * depthTarget.GetWidth() + row.targetPos.x;
+		alignas(16) float depthValues[RASTER_BLOCK_SIZE]{};
+		memcpy(depthValues, depthRow, row.width * sizeof(float));
+
+		alignas(16) float bary0[RASTER_BLOCK_SIZE];
+		alignas(16) float bary1[RASTER_BLOCK_SIZE];
+		alignas(16) float bary2[RASTER_BLOCK_SIZE];
+		alignas(16) float oneOverW[RASTER_BLOCK_SIZE];
+		alignas(16) float depthValuesPassed[RASTER_BLOCK_SIZE];
+		u32 passedMask = 0;
+		const bool testEqual = depthTarget.GetDepthCompare() == EDepthCompare::EQUAL;
+
+		const __m128 oneOverDoubleArea = _mm_set1_ps(setup.oneOverDoubleArea);
+		for (int group = 0; group < row.width; group += 4)
+		{
+			__m128i coverage = _mm_cmpgt_epi32(_mm_set1_epi32(row.width), _mm_setr_epi32(group, group + 1, group + 2, group + 3));
+
+			__m128i edgeValuesOr = _mm_setzero_si128();
+			__m128 bary[3];
+			for (int i = 0; i < 3; i++)
+			{
+				const i32 stepX = static_cast<i32>(setup.edges[i].a);
+				const i32 groupEdgeValue = static_cast<i32>(row.edgeValues[i]) + group * stepX;
+				const __m128i edgeValues = _mm_add_epi32(_mm_set1_epi32(groupEdgeValue), _mm_setr_epi32(0, stepX, 2 * stepX, 3 * stepX));
+
+				edgeValuesOr = _mm_or_si128(edgeValuesOr, edgeValues);
+				bary[i] = _mm_mul_ps(_mm_cvtepi32_ps(edgeValues), oneOverDoubleArea);
+			}
+
+			if (!row.fullyCovered)
+				coverage = _mm_and_si128(coverage, _mm_cmpgt_epi32(edgeValuesOr, _mm_set1_epi32(-1)));
+
+			const __m128 depth = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(bary[0], _mm_set1_ps(setup.vertsZ.x)),
+				_mm_mul_ps(bary[1], _mm_set1_ps(setup.vertsZ.y))),
+				_mm_mul_ps(bary[2], _mm_set1_ps(setup.vertsZ.z)));
+
+			// not greater or equal instead of less so NaN depth behaves the same as in ZBuffer::TestAndWrite
+			const __m128 storedDepth = _mm_load_ps(depthValues + group);
+			const __m128 passed = _mm_and_ps(_mm_castsi128_ps(coverage),
+				testEqual ? _mm_cmpeq_ps(depth, storedDepth) : _mm_cmpnge_ps(depth, storedDepth));
+			_mm_store_ps(depthValues + group, _mm_or_ps(_mm_and_ps(passed, depth), _mm_andnot_ps(passed, storedDepth)));
+
+			passedMask |= static_cast<u32>(_mm_movemask_ps(passed)) << group;
+
+			_mm_store_ps(depthValuesPassed + group, depth);
+
+			_mm_store_ps(bary0 + group, bary[0]);
+			_mm_store_ps(bary1 + group, bary[1]);
+			_mm_store_ps(bary2 + group, bary[2]);
+			_mm_store_ps(oneOverW + group, _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(bary[0], _mm_set1_ps(setup.vertsOneOverW.x)),
+				_mm_mul_ps(bary[1], _mm_set1_ps(setup.vertsOneOverW.y))),
+				_mm_mul_ps(bary[2], _mm_set1_ps(setup.vertsOneOverW.z))));
+		}
+
+		if (passedMask == 0)
+			return;
+
+		memcpy(depthRow, depthValues, row.width * sizeof(float));
+		if (IsDepthOnly(fragmentShader))
+			return;
+
+		ShadePassedPixels(setup, row, passedMask, bary0, bary1, bary2, oneOverW, depthValuesPassed, colorTarget, fragmentShader);
+#else
+		RasterizeRow_Scalar(setup, row, colorTarget, depthTarget, fragmentShader);
+#endif
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	SOR_TARGET_AVX2 void RasterizeRow_AVX2(const TriangleSetup& setup, const RasterRow& row, Texture& colorTarget, ZBufferBase& depthTarget,
+		IFragmentShader& fragmentShader)
+	{
+#if SOR_SIMD_X86
+		static_assert(RASTER_BLOCK_SIZE == 8, "AVX2 kernel processes the whole block row at once");
+
+		const __m256i pixelIdx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		__m256i coverage = _mm256_cmpgt_epi32(_mm256_set1_epi32(row.width), pixelIdx);
+
+		const __m256 oneOverDoubleArea = _mm256_set1_ps(setup.oneOverDoubleArea);
+		__m256i edgeValuesOr = _mm256_setzero_si256();
+		__m256 bary[3];
+		for (int i = 0; i < 3; i++)
+		{
+			const __m256i edgeValues = _mm256_add_epi32(_mm256_set1_epi32(static_cast<i32>(row.edgeValues[i])),
+				_mm256_mullo_epi32(pixelIdx, _mm256_set1_epi32(static_cast<i32>(setup.edges[i].a))));
+
+			edgeValuesOr = _mm256_or_si256(edgeValuesOr, edgeValues);
+			bary[i] = _mm256_mul_ps(_mm256_cvtepi32_ps(edgeValues), oneOverDoubleArea);
+		}
+
+		if (!row.fullyCovered)
+			coverage = _mm256_and_si256(coverage, _mm256_cmpgt_epi32(edgeValuesOr, _mm256_set1_epi32(-1)));
+
+		if (_mm256_testz_si256(coverage, coverage))
+			return;
+
+		const __m256 depth = _mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(bary[0], _mm256_set1_ps(setup.vertsZ.x)),
+			_mm256_mul_ps(bary[1], _mm256_set1_ps(setup.vertsZ.y))),
+			_mm256_mul_ps(bary[2], _mm256_set1_ps(setup.vertsZ.z)));
+
+		// pixels past the end of the row are masked out so they're never touched even if they're outside of the buffer
+		float* depthRow = depthTarget.GetFloatData() + row.targetPos.y * depthTarget.GetWidth() + row.targetPos.x;
+		const __m256 storedDepth = _mm256_maskload_ps(depthRow, coverage);
+		// not greater or equal instead of less so NaN depth behaves the same as in ZBuffer::TestAndWrite
+		const __m256 passedDepth = depthTarget.GetDepthCompare() == EDepthCompare::EQUAL
+			? _mm256_cmp_ps(depth, storedDepth, _CMP_EQ_OQ) : _mm256_cmp_ps(depth, storedDepth, _CMP_NGE_UQ);
+		const __m256i passed = _mm256_and_si256(coverage, _mm256_castps_si256(passedDepth));
+		_mm256_maskstore_ps(depthRow, passed, depth);
+
+		const u32 passedMask = static_cast<u32>(_mm256_movemask_ps(_mm256_castsi256_ps(passed)));
+		if (passedMask == 0 || IsDepthOnly(fragmentShader))
+			return;
+
+		alignas(32) float bary0[RASTER_BLOCK_SIZE];
+		alignas(32) float bary1[RASTER_BLOCK_SIZE];
+		alignas(32) float bary2[RASTER_BLOCK_SIZE];
+		alignas(32) float oneOverW[RASTER_BLOCK_SIZE];
+		alignas(32) float depthValues[RASTER_BLOCK_SIZE];
+		_mm256_store_ps(depthValues, depth);
+		_mm256_store_ps(bary0, bary[0]);
+		_mm256_store_ps(bary1, bary[1]);
+		_mm256_store_ps(bary2, bary[2]);
+		_mm256_store_ps(oneOverW, _mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(bary[0], _mm256_set1_ps(setup.vertsOneOverW.x)),
+			_mm256_mul_ps(bary[1], _mm256_set1_ps(setup.vertsOneOverW.y))),
+			_mm256_mul_ps(bary[2], _mm256_set1_ps(setup.vertsOneOverW.z))));
+
+		ShadePassedPixels(setup, row, passedMask, bary0, bary1, bary2, oneOverW, depthValues, colorTarget, fragmentShader);
+#else
+		RasterizeRow_Scalar(setup, row, colorTarget, depthTarget, fragmentShader);
+#endif
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	bool RasterizeSmallTriangle(const TriangleSetup& setup, const RasterFootprint& footprint, Texture& colorTarget,
+		ZBufferBase& depthTarget, IFragmentShader& fragmentShader)
+	{
+		assert(footprint.width <= SMALL_TRIANGLE_MAX_SIZE && footprint.height <= SMALL_TRIANGLE_MAX_SIZE);
+
+		// edge functions are linear so they are the largest in the corners of the full footprint
+		bool edgeValuesFit32Bit = true;
+		for (int i = 0; i < 3; i++)
+		{
+			for (int x : { 0, SMALL_TRIANGLE_MAX_SIZE - 1 })
+			{
+				for (int y : { 0, SMALL_TRIANGLE_MAX_SIZE - 1 })
+				{
+					const i64 value = footprint.edgeValues[i] + setup.edges[i].a * x + setup.edges[i].b * y;
+					if (value < std::numeric_limits<i32>::min() || value > std::numeric_limits<i32>::max())
+						edgeValuesFit32Bit = false;
+				}
+			}
+		}
+
+		u32 coverage;
+#if SOR_SIMD_X86
+		switch (edgeValuesFit32Bit ? std::min(GetSimdLevel(), MAX_RASTER_SIMD_LEVEL) : ESimdLevel::SCALAR)
+		{
+		case ESimdLevel::AVX2:
+			coverage = GetFootprintCoverage_AVX2(setup, footprint);
+			break;
+		case ESimdLevel::SSE2:
+			coverage = GetFootprintCoverage_SSE2(setup, footprint);
+			break;
+		default:
+			coverage = GetFootprintCoverage_Scalar(setup, footprint);
+			break;
+		}
+#else
+		coverage = GetFootprintCoverage_Scalar(setup, footprint);
+#endif
+
+		// only the part of the footprint inside of the rasterized area
+		u32 footprintMask = 0;
+		for (int y = 0; y < footprint.height; y++)
+			footprintMask |= (BIT_FLAG(footprint.width) - 1) << (y * SMALL_TRIANGLE_MAX_SIZE);
+		coverage &= footprintMask;
+
+		const EDepthTestStage depthTestStage = fragmentShader.GetDepthTestStage();
+		const bool depthOnly = IsDepthOnly(fragmentShader);
+		bool depthWritten = false;
+		while (coverage != 0)
+		{
+			const int pixelIdx = std::countr_zero(coverage);
+			coverage &= coverage - 1;
+
+			const int x = pixelIdx % SMALL_TRIANGLE_MAX_SIZE;
+			const int y = pixelIdx / SMALL_TRIANGLE_MAX_SIZE;
+			const Vec3f barycentricCoordinates{
+				static_cast<float>(footprint.edgeValues[0] + setup.edges[0].a * x + setup.edges[0].b * y) * setup.oneOverDoubleArea,
+				static_cast<float>(footprint.edgeValues[1] + setup.edges[1].a * x + setup.edges[1].b * y) * setup.oneOverDoubleArea,
+				static_cast<float>(footprint.edgeValues[2] + setup.edges[2].a * x + setup.edges[2].b * y) * setup.oneOverDoubleArea };
+
+			depthWritten |= ShadePixel(footprint.targetPos.x + x, footprint.targetPos.y + y, barycentricCoordinates, depthTestStage,
+				depthOnly, setup, colorTarget, depthTarget, fragmentShader);
+		}
+
+		return depthWritten;
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	RasterRowFunc GetRasterRowFunc(bool edgeValuesFit32Bit, ZBufferBase& depthTarget, const IFragmentShader& fragmentShader)
+	{
+		if (!edgeValuesFit32Bit || depthTarget.GetFloatData() == nullptr || fragmentShader.GetDepthTestStage() != EDepthTestStage::EARLY)
+			return &RasterizeRow_Scalar;
+
+		switch (std::min(GetSimdLevel(), MAX_RASTER_SIMD_LEVEL))
+		{
+		case ESimdLevel::AVX2:
+			return &RasterizeRow_AVX2;
+		case ESimdLevel::SSE2:
+			return &RasterizeRow_SSE2;
+		default:
+			return &RasterizeRow_Scalar;
+		}
+	}
+}
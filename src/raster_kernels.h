@@ -0,0 +1,49 @@
+#pragma once
+
+#include "triangle_drawing.h"
+#include "cpu_features.h"
+
+namespace sor
+{
+	// horizontal run of at most RASTER_BLOCK_SIZE pixels within one block
+	struct RasterRow
+	{
+		Vec2i targetPos;					// first pixel of the row relative to the render target
+		int width;
+		std::array<i64, 3> edgeValues;		// at the first pixel
+		bool fullyCovered;					// the whole row is inside of the triangle, no need to test
+	};
+
+	// whole bounding box of a triangle of at most SMALL_TRIANGLE_MAX_SIZE x SMALL_TRIANGLE_MAX_SIZE pixels
+	struct RasterFootprint
+	{
+		Vec2i targetPos;					// first pixel relative to the render target
+		int width;
+		int height;
+		std::array<i64, 3> edgeValues;		// at the first pixel
+	};
+
+	// Tests coverage and depth of every pixel of the row, writes the depth of the ones that pass and runs the fragment
+	// shader for them (in the order the shader's depth test stage needs), unless it's EFragmentShaderFlags::DEPTH_ONLY.
+	// All kernels produce exactly the same result, the wide ones only do the per pixel math for several pixels at once.
+	using RasterRowFunc = void(*)(const TriangleSetup& setup, const RasterRow& row, Texture& colorTarget, ZBufferBase& depthTarget,
+		IFragmentShader& fragmentShader);
+
+	void RasterizeRow_Scalar(const TriangleSetup& setup, const RasterRow& row, Texture& colorTarget, ZBufferBase& depthTarget,
+		IFragmentShader& fragmentShader);
+	void RasterizeRow_SSE2(const TriangleSetup& setup, const RasterRow& row, Texture& colorTarget, ZBufferBase& depthTarget,
+		IFragmentShader& fragmentShader);
+	void RasterizeRow_AVX2(const TriangleSetup& setup, const RasterRow& row, Texture& colorTarget, ZBufferBase& depthTarget,
+		IFragmentShader& fragmentShader);
+
+	// For tiny triangles, the coverage of the whole footprint is computed at once (with SIMD where possible) and only the
+	// covered pixels are then tested and shaded one by one, with any depth test stage. Most tiny triangles don't cover
+	// any pixel at all so that's all they cost. Returns whether any depth was written.
+	bool RasterizeSmallTriangle(const TriangleSetup& setup, const RasterFootprint& footprint, Texture& colorTarget,
+		ZBufferBase& depthTarget, IFragmentShader& fragmentShader);
+
+	// Picks the widest kernel the CPU supports (up to MAX_RASTER_SIMD_LEVEL). The wide kernels keep edge values in 32 bits,
+	// need direct access to float depth values and only do early depth test so the scalar one is returned when any of
+	// that isn't the case.
+	RasterRowFunc GetRasterRowFunc(bool edgeValuesFit32Bit, ZBufferBase& depthTarget, const IFragmentShader& fragmentShader);
+}
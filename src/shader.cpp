@@ -8,94 +8,205 @@
 #include <iostream>
 
 #include "my_gl.h"
+#include "vertex_processing.h"
 
 namespace sor
 {
+	IShaderBase::VertexVaryingData IShaderBase::BlendVaryingData(const TriangleVaryingData& varyingData, const Vec3f& weights)
+	{
+		VertexVaryingData blended;
+		for (int slot = 0; slot < VARYING_DATA_SLOT_COUNT; slot++)
+		{
+			blended.data4[slot] = varyingData[0].data4[slot] * weights.x + varyingData[1].data4[slot] * weights.y
+				+ varyingData[2].data4[slot] * weights.z;
+			blended.data3[slot] = varyingData[0].data3[slot] * weights.x + varyingData[1].data3[slot] * weights.y
+				+ varyingData[2].data3[slot] * weights.z;
+			blended.data2[slot] = varyingData[0].data2[slot] * weights.x + varyingData[1].data2[slot] * weights.y
+				+ varyingData[2].data2[slot] * weights.z;
+			blended.data1[slot] = varyingData[0].data1[slot] * weights.x + varyingData[1].data1[slot] * weights.y
+				+ varyingData[2].data1[slot] * weights.z;
+		}
+
+		return blended;
+	}
+
+	bool IFragmentShader::ShadeSpan(const FragmentSpan& span, Texture& colorTarget)
+	{
+		const EDepthTestStage depthTestStage = GetDepthTestStage();
+
+		Vec3f barycentricCoordinates = span.barycentricCoordinates;
+		float depth = span.depth;
+		float interpolatedOneOverW = span.interpolatedOneOverW;
+		float* depthValue = span.depthRow;
+		bool depthWritten = false;
+
+		for (int x = span.xStart; x < span.xEnd; x++)
+		{
+			if (depthTestStage == EDepthTestStage::LATE || PassesDepthTest(span.depthCompare, depth, *depthValue))
+			{
+				if (depthTestStage == EDepthTestStage::EARLY)
+				{
+					*depthValue = depth;
+					depthWritten = true;
+				}
+
+				m_FragmentDepth = depth;
+				SetInterpolationData({ .barycentricCoordinates = barycentricCoordinates, .verticesW = span.verticesW,
+					.interpolatedOneOverW = interpolatedOneOverW });
+
+				if (fragment() && (depthTestStage != EDepthTestStage::LATE || PassesDepthTest(span.depthCompare, m_FragmentDepth, *depthValue)))
+				{
+					if (depthTestStage != EDepthTestStage::EARLY)
+					{
+						*depthValue = m_FragmentDepth;
+						depthWritten = true;
+					}
+
+					colorTarget.SetPixelUnchecked(x, span.y, TGAColor::FromVec4(m_FinalColor));
+				}
+			}
+
+			barycentricCoordinates = barycentricCoordinates + span.barycentricCoordinatesStep;
+			depth += span.depthStep;
+			interpolatedOneOverW += span.interpolatedOneOverWStep;
+			depthValue++;
+		}
+
+		return depthWritten;
+	}
+
 	Vec4f IFragmentShader::GetInterpolatedData4(i32 dataHash) const
 	{
-		return GetInterpolatedData(dataHash, m_VaryingData4);
+		return GetInterpolatedData<Vec4f>(dataHash);
 	}
 
 	Vec3f IFragmentShader::GetInterpolatedData3(i32 dataHash) const
 	{
-		return GetInterpolatedData(dataHash, m_VaryingData3);
+		return GetInterpolatedData<Vec3f>(dataHash);
 	}
 
 	Vec2f IFragmentShader::GetInterpolatedData2(i32 dataHash) const
 	{
-		return GetInterpolatedData(dataHash, m_VaryingData2);
+		return GetInterpolatedData<Vec2f>(dataHash);
 	}
 
 	float IFragmentShader::GetInterpolatedData1(i32 dataHash) const
 	{
-		return GetInterpolatedData(dataHash, m_VaryingData1);
+		return GetInterpolatedData<float>(dataHash);
 	}
 
 	Vec2f IFragmentShader::GetVaryingData2(i32 dataHash, u8 vertIndex) const
 	{
-		return GetVaryingData(dataHash, m_VaryingData2, vertIndex);
+		return GetVaryingData<Vec2f>(dataHash, vertIndex);
 	}
 
 	Vec3f IFragmentShader::GetVaryingData3(i32 dataHash, u8 vertIndex) const
 	{
-		return GetVaryingData(dataHash, m_VaryingData3, vertIndex);
+		return GetVaryingData<Vec3f>(dataHash, vertIndex);
 	}
 
 	Vec4f IFragmentShader::GetVaryingData4(i32 dataHash, u8 vertIndex) const
 	{
-		return GetVaryingData(dataHash, m_VaryingData4, vertIndex);
+		return GetVaryingData<Vec4f>(dataHash, vertIndex);
 	}
 
-
-	void IVertexShader::SetVaryingData4(i32 hash, u8 vertexIdx, const Vec4f& data)
+	//--------------------------------------------------------------------------------------------------
+	void BasicScreenSpace::VertexBatch(int first, int count, const std::array<float*, 4>& positions,
+		VertexVaryingData* varyingData) const
 	{
-		SetVaryingData(hash, vertexIdx, data, m_VaryingData4);
+		assert(m_Model && count <= VERTEX_BATCH_SIZE);
+
+		const Model::UniqueVertexStreams& streams = m_Model->GetUniqueVertexStreams();
+		alignas(32) std::array<float, VERTEX_BATCH_SIZE> ones;
+		ones.fill(1.f);
+		alignas(32) float positionsWS[4][VERTEX_BATCH_SIZE];
+		alignas(32) float positionsVS[4][VERTEX_BATCH_SIZE];
+
+		TransformStreams(ModelMat, { &streams.positionX[first], &streams.positionY[first], &streams.positionZ[first], ones.data() },
+			{ positionsWS[0], positionsWS[1], positionsWS[2], positionsWS[3] }, count);
+		// the view and the projection are multiplied once for the whole batch, PositionBatch() has to use the same product
+		const std::array<const float*, 4> positionsWSStreams{ positionsWS[0], positionsWS[1], positionsWS[2], positionsWS[3] };
+		TransformStreams(ProjectionMat * ViewMat, positionsWSStreams, positions, count);
+		TransformStreams(ViewMat, positionsWSStreams, { positionsVS[0], positionsVS[1], positionsVS[2], positionsVS[3] }, count);
+
+		for (int i = 0; i < count; i++)
+		{
+			VertexVaryingData& data = varyingData[i];
+			data.Get<Vec2f>(UV_VARYING_DATA_HASH) = Vec2f{ streams.u[first + i], streams.v[first + i] };
+			data.Get<Vec4f>(VERTEX_WS_VARYING_DATA_HASH) = Vec4f{ positionsWS[0][i], positionsWS[1][i], positionsWS[2][i], positionsWS[3][i] };
+			data.Get<Vec4f>(VERTEX_CS_VARYING_DATA_HASH) = Vec4f{ positions[0][i], positions[1][i], positions[2][i], positions[3][i] };
+			data.Get<Vec3f>(VERTEX_VIEWSPACE_VARYING_DATA_HASH) =
+				Vec4f{ positionsVS[0][i], positionsVS[1][i], positionsVS[2][i], positionsVS[3][i] }.FromHomogeneous();
+		}
 	}
 
-	void IVertexShader::SetVaryingData3(i32 hash, u8 vertexIdx, const Vec3f& data)
+	//--------------------------------------------------------------------------------------------------
+	void BasicScreenSpace::PositionBatch(int first, int count, const std::array<float*, 4>& positions) const
 	{
-		SetVaryingData(hash, vertexIdx, data, m_VaryingData3);
-	}
+		assert(m_Model && count <= VERTEX_BATCH_SIZE);
 
-	void IVertexShader::SetVaryingData2(i32 hash, u8 vertexIdx, const Vec2f& data)
-	{
-		SetVaryingData(hash, vertexIdx, data, m_VaryingData2);
-	}
+		const Model::UniqueVertexStreams& streams = m_Model->GetUniqueVertexStreams();
+		alignas(32) std::array<float, VERTEX_BATCH_SIZE> ones;
+		ones.fill(1.f);
+		alignas(32) float positionsWS[4][VERTEX_BATCH_SIZE];
 
-	void IVertexShader::SetVaryingData1(i32 hash, u8 vertexIdx, const float& data)
-	{
-		SetVaryingData(hash, vertexIdx, data, m_VaryingData1);
+		TransformStreams(ModelMat, { &streams.positionX[first], &streams.positionY[first], &streams.positionZ[first], ones.data() },
+			{ positionsWS[0], positionsWS[1], positionsWS[2], positionsWS[3] }, count);
+		TransformStreams(ProjectionMat * ViewMat, { positionsWS[0], positionsWS[1], positionsWS[2], positionsWS[3] }, positions, count);
 	}
 
 	//--------------------------------------------------------------------------------------------------
-	Vec4f BasicScreenSpace::vertex(u32 faceIdx, u8 vertIdx)
+	void BasicScreenSpaceWithNormals::VertexBatch(int first, int count, const std::array<float*, 4>& positions,
+		VertexVaryingData* varyingData) const
 	{
-		assert(m_Model);
-
-		Vec2f uv = m_Model->UVForFaceAndVertex(faceIdx, vertIdx);
-		SetVaryingData2(UV_VARYING_DATA_HASH, vertIdx, uv);
+		BasicScreenSpace::VertexBatch(first, count, positions, varyingData);
 
-		Vec3f vertex = m_Model->VertexForFace(faceIdx, vertIdx);
-		Vec4f positionWS = (ModelMat * vertex.ToPoint());
+		const Model::UniqueVertexStreams& streams = m_Model->GetUniqueVertexStreams();
+		if (streams.normalX.empty())
+		{
+			// the model has no normals the shader could use
+			for (int i = 0; i < count; i++)
+				varyingData[i].Get<Vec3f>(NORMAL_NDC_VARYING_DATA_HASH) = Vec3f{};
+			return;
+		}
 
-		SetVaryingData4(VERTEX_WS_VARYING_DATA_HASH, vertIdx, positionWS);
+		alignas(32) std::array<float, VERTEX_BATCH_SIZE> zeros{};
+		alignas(32) float normalsNDC[4][VERTEX_BATCH_SIZE];
 
-		Vec4f positionCS = ProjectionMat * ViewMat * positionWS;
-		SetVaryingData4(VERTEX_CS_VARYING_DATA_HASH, vertIdx, positionCS);
+		TransformStreams(MVP_IT, { &streams.normalX[first], &streams.normalY[first], &streams.normalZ[first], zeros.data() },
+			{ normalsNDC[0], normalsNDC[1], normalsNDC[2], normalsNDC[3] }, count);
 
-		SetVaryingData3(VERTEX_VIEWSPACE_VARYING_DATA_HASH, vertIdx, (ViewMat * positionWS).FromHomogeneous());
-
-		return positionCS;
+		for (int i = 0; i < count; i++)
+			varyingData[i].Get<Vec3f>(NORMAL_NDC_VARYING_DATA_HASH) = Vec3f{ normalsNDC[0][i], normalsNDC[1][i], normalsNDC[2][i] };
 	}
 
 	//--------------------------------------------------------------------------------------------------
-	Vec4f BasicScreenSpaceWithNormals::vertex(u32 faceIdx, u8 vertIdx)
+	bool DepthOnlyShader::fragment()
 	{
-		Vec3f vertexNormal = m_Model->NormalForFaceAndVertex(faceIdx, vertIdx);
-		Vec3f vertexNormalNDC = (MVP_IT * vertexNormal.ToDirection()).ToVec3();
-		SetVaryingData3(NORMAL_NDC_VARYING_DATA_HASH, vertIdx, vertexNormalNDC);
+		assert(false && "depth only shader is never run");
+		return false;
+	}
 
-		return BasicScreenSpace::vertex(faceIdx, vertIdx);
+	//--------------------------------------------------------------------------------------------------
+	bool DepthOnlyShader::ShadeSpan(const FragmentSpan& span, Texture& /*colorTarget*/)
+	{
+		float depth = span.depth;
+		float* depthValue = span.depthRow;
+		bool depthWritten = false;
+
+		for (int x = span.xStart; x < span.xEnd; x++)
+		{
+			if (PassesDepthTest(span.depthCompare, depth, *depthValue))
+			{
+				*depthValue = depth;
+				depthWritten = true;
+			}
+
+			depth += span.depthStep;
+			depthValue++;
+		}
+
+		return depthWritten;
 	}
 
 	//--------------------------------------------------------------------------------------------------
@@ -103,9 +214,9 @@ namespace sor
 	{
 		assert(m_AlbedoTexture);
 
-		const auto* tex = m_AlbedoTexture;
 		Vec2f uv = GetInterpolatedData2(UV_VARYING_DATA_HASH);
-		TGAColor color = tex->get(tex->get_width() * uv.u, tex->get_height() * uv.v);
+		TGAColor color = m_AlbedoTexture->Sample(uv, GetInterpolatedDataDdx<Vec2f>(UV_VARYING_DATA_HASH),
+			GetInterpolatedDataDdy<Vec2f>(UV_VARYING_DATA_HASH));
 
 		m_FinalColor = color.ToFloat();
 
@@ -120,9 +231,9 @@ namespace sor
 		Vec3f normal = GetInterpolatedData3(NORMAL_NDC_VARYING_DATA_HASH);
 		const float NdotL = std::max(normal.dot(LightDir), 0.0f);
 
-		const auto* tex = m_AlbedoTexture;
 		Vec2f uv = GetInterpolatedData2(UV_VARYING_DATA_HASH);
-		TGAColor color = tex->get(tex->get_width() * uv.u, tex->get_height() * uv.v);
+		TGAColor color = m_AlbedoTexture->Sample(uv, GetInterpolatedDataDdx<Vec2f>(UV_VARYING_DATA_HASH),
+			GetInterpolatedDataDdy<Vec2f>(UV_VARYING_DATA_HASH));
 
 		m_FinalColor = color.ToFloat() * NdotL;
 
@@ -149,16 +260,16 @@ namespace sor
 		assert(m_AlbedoTexture);
 
 		Vec2f uv = GetInterpolatedData2(UV_VARYING_DATA_HASH);
+		const Vec2f uvDdx = GetInterpolatedDataDdx<Vec2f>(UV_VARYING_DATA_HASH);
+		const Vec2f uvDdy = GetInterpolatedDataDdy<Vec2f>(UV_VARYING_DATA_HASH);
 
-		const auto* albText = m_AlbedoTexture;
-		TGAColor color = albText->get(albText->get_width() * uv.u, albText->get_height() * uv.v);
+		TGAColor color = m_AlbedoTexture->Sample(uv, uvDdx, uvDdy);
 
-		const auto* normText = m_NormalTexture;
-		TGAColor textureNormalRaw = normText->get(normText->get_width() * uv.u, albText->get_height() * uv.v);
+		TGAColor textureNormalRaw = m_NormalTexture->Sample(uv, uvDdx, uvDdy);
 
 		TGAColor specularTextureColor;
 		if (m_SpecularTexture)
-			specularTextureColor = m_SpecularTexture->get(m_SpecularTexture->get_width() * uv.u, m_SpecularTexture->get_height() * uv.v);
+			specularTextureColor = m_SpecularTexture->Sample(uv, uvDdx, uvDdy);
 
 		Vec3f textureNormal = textureNormalRaw.ToFloat().ToVec3();
 		textureNormal = textureNormal * 2.0;
@@ -182,20 +293,25 @@ namespace sor
 		A.SetRow(0, Vec3d{ firstDelta.x, firstDelta.y, firstDelta.z });
 		A.SetRow(1, Vec3d{ secondDelta.x, secondDelta.y, secondDelta.z });
 		A.SetRow(2, Vec3d{ vertexNormal.x, vertexNormal.y, vertexNormal.z });
-		Mat3d A_I = A.GetInverse();
-		//std::cout << A_I << "\n";
-		const Vec3d tangentDouble = (A_I * Vec3d(uv1.u - uv0.u, uv2.u - uv0.u, 0.f)).normalize();
-		const Vec3d bitangentDouble = (A_I * Vec3d(uv1.v - uv0.v, uv2.v - uv0.v, 0.f)).normalize();
-		const Vec3f tangent = Vec3f{ (float)tangentDouble.x, (float)tangentDouble.y, (float)tangentDouble.z };
-		const Vec3f bitangent = Vec3f{ (float)bitangentDouble.x, (float)bitangentDouble.y, (float)bitangentDouble.z };
-		//std::cout << Vec3f(uv1.u - uv0.u, uv2.u - uv0.u, 0.f) << '\n';
-		//std::cout << Vec3f(uv1.v - uv0.v, uv2.v - uv0.v, 0.f) << '\n';
-		//std::cout << '\n';
-		Mat3f tangentSpaceMat;
-		tangentSpaceMat.SetColumn(0, tangent);
-		tangentSpaceMat.SetColumn(1, bitangent);
-		tangentSpaceMat.SetColumn(2, vertexNormal);
-		const Vec3f textureNormalTStoNDC = (tangentSpaceMat * textureNormal).normalize();
+		// a degenerate triangle has no tangent space, it's lit by the interpolated normal alone
+		Vec3f textureNormalTStoNDC = vertexNormal;
+		Mat3d A_I;
+		if (A.TryInverse(A_I))
+		{
+			//std::cout << A_I << "\n";
+			const Vec3d tangentDouble = (A_I * Vec3d(uv1.u - uv0.u, uv2.u - uv0.u, 0.f)).normalize();
+			const Vec3d bitangentDouble = (A_I * Vec3d(uv1.v - uv0.v, uv2.v - uv0.v, 0.f)).normalize();
+			const Vec3f tangent = Vec3f{ (float)tangentDouble.x, (float)tangentDouble.y, (float)tangentDouble.z };
+			const Vec3f bitangent = Vec3f{ (float)bitangentDouble.x, (float)bitangentDouble.y, (float)bitangentDouble.z };
+			//std::cout << Vec3f(uv1.u - uv0.u, uv2.u - uv0.u, 0.f) << '\n';
+			//std::cout << Vec3f(uv1.v - uv0.v, uv2.v - uv0.v, 0.f) << '\n';
+			//std::cout << '\n';
+			Mat3f tangentSpaceMat;
+			tangentSpaceMat.SetColumn(0, tangent);
+			tangentSpaceMat.SetColumn(1, bitangent);
+			tangentSpaceMat.SetColumn(2, vertexNormal);
+			textureNormalTStoNDC = (tangentSpaceMat * textureNormal).normalize();
+		}
 		// transform rest of the necessary vectors into NDC space and compute diffuse and specular
 		const Vec3f lightNDC = (ViewMat * LightDir.ToDirection()).ToVec3().normalize();
 		//std::cout << normal << '\n';
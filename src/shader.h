@@ -1,7 +1,9 @@
 #pragma once
 #include <cassert>
-#include <map>
+#include <memory>
+#include <type_traits>
 
+#include "core.h"
 #include "geometry.h"
 #include "model.h"
 #include "tgaimage.h"
@@ -18,6 +20,9 @@ namespace sor
 	class IShaderBase
 	{
 	public:
+		// varying data hashes are used directly as slot indices so they all have to be smaller than this
+		static constexpr i32 VARYING_DATA_SLOT_COUNT = 6;
+
 		template<typename DataType>
 		using VertexDataContainer = std::array<DataType, 3>;
 		using Vec4Container = VertexDataContainer < Vec4f>;
@@ -25,21 +30,79 @@ namespace sor
 		using Vec2Container = VertexDataContainer<Vec2f>;
 		using FloatContainer = VertexDataContainer<float>;
 
-		template<typename DataType>
-		using VaryingDataContainer = std::map<i32, VertexDataContainer<DataType>>;
-		using VaryingDataContainer1 = VaryingDataContainer<float>;
-		using VaryingDataContainer2 = VaryingDataContainer<Vec2f>;
-		using VaryingDataContainer3 = VaryingDataContainer<Vec3f>;
-		using VaryingDataContainer4 = VaryingDataContainer<Vec4f>;
+		// all varying data of a single vertex, flat so it can be cheaply copied around with the triangle
+		struct VertexVaryingData
+		{
+			std::array<Vec4f, VARYING_DATA_SLOT_COUNT> data4;
+			std::array<Vec3f, VARYING_DATA_SLOT_COUNT> data3;
+			std::array<Vec2f, VARYING_DATA_SLOT_COUNT> data2;
+			std::array<float, VARYING_DATA_SLOT_COUNT> data1;
+
+			template<typename DataType>
+			DataType& Get(i32 dataHash)
+			{
+				assert(dataHash >= 0 && dataHash < VARYING_DATA_SLOT_COUNT);
+
+				if constexpr (std::is_same_v<DataType, Vec4f>) return data4[dataHash];
+				else if constexpr (std::is_same_v<DataType, Vec3f>) return data3[dataHash];
+				else if constexpr (std::is_same_v<DataType, Vec2f>) return data2[dataHash];
+				else return data1[dataHash];
+			}
+
+			template<typename DataType>
+			const DataType& Get(i32 dataHash) const
+			{
+				return const_cast<VertexVaryingData*>(this)->Get<DataType>(dataHash);
+			}
+		};
+		using TriangleVaryingData = VertexDataContainer<VertexVaryingData>;
 
+		// varying data of a point given by its weights of the triangle vertices, used for the vertices made by clipping
+		static VertexVaryingData BlendVaryingData(const TriangleVaryingData& varyingData, const Vec3f& weights);
+
+		virtual ~IShaderBase() = default;
+
+		// lets the varying data written by the vertex shader for one triangle be stored and later handed to
+		// a different shader instance (e.g. one running on another thread)
+		const TriangleVaryingData& GetTriangleVaryingData() const { return m_VaryingData; }
+		void SetTriangleVaryingData(const TriangleVaryingData& varyingData) { m_VaryingData = varyingData; }
 
 	protected:
-		std::map<i32, Vec4Container> m_VaryingData4;
-		std::map<i32, Vec3Container> m_VaryingData3;
-		std::map<i32, Vec2Container> m_VaryingData2;
-		std::map<i32, FloatContainer> m_VaryingData1;
+		TriangleVaryingData m_VaryingData;
+	};
+
+	// what a fragment shader does besides computing the color, decides when the depth can be tested
+	enum class EFragmentShaderFlags : u8
+	{
+		NONE = 0,
+		DISCARDS = BIT_FLAG(0),			// fragment() can return false
+		WRITES_DEPTH = BIT_FLAG(1),		// fragment() can change m_FragmentDepth
+		SPANS_ONLY = BIT_FLAG(2),		// all the work is done in ShadeSpan() so the triangles are always rasterized in spans
+		USES_DERIVATIVES = BIT_FLAG(3),	// fragment() uses screen space derivatives so they're set for every triangle
+		DEPTH_ONLY = BIT_FLAG(4)		// fragment() is never run, the rasterizer only tests and writes the depth
+	};
+	DEFINE_ENUM_OPS(EFragmentShaderFlags);
+
+	enum class EDepthTestStage : u8
+	{
+		EARLY,						// depth is tested and written before fragment(), occluded fragments aren't shaded at all
+		EARLY_TEST_LATE_WRITE,		// tested before fragment() but written only for fragments that weren't discarded
+		LATE						// tested and written after fragment() with the depth it has written
 	};
 
+	// how the depth of a fragment is compared with the stored one for the fragment to pass
+	enum class EDepthCompare : u8
+	{
+		LESS,		// closer than what's stored
+		EQUAL		// exactly what's stored, for shading after a depth prepass has written the final depth
+	};
+
+	// LESS is not greater or equal so NaN depth passes it, the rasterizer kernels compare the same way
+	inline bool PassesDepthTest(EDepthCompare depthCompare, float depth, float storedDepth)
+	{
+		return depthCompare == EDepthCompare::EQUAL ? depth == storedDepth : !(depth >= storedDepth);
+	}
+
 	//--------------------------------------------------------------------------------------------------
 	class IFragmentShader : virtual public IShaderBase
 	{
@@ -51,12 +114,60 @@ namespace sor
 			float interpolatedOneOverW;					// se we can transform intepolated data back from "divided by w space"
 		};
 
+		// Pixels [xStart, xEnd) of one row of a triangle. Interpolated values are given for the first pixel together with
+		// how much they change from one pixel to the next.
+		struct FragmentSpan
+		{
+			int y;
+			int xStart;
+			int xEnd;
+
+			Vec3f barycentricCoordinates;
+			Vec3f barycentricCoordinatesStep;
+			float depth;
+			float depthStep;
+			float interpolatedOneOverW;
+			float interpolatedOneOverWStep;
+			Vec3f verticesW;
+
+			float* depthRow;			// depth buffer value of the first pixel, spans are only used with float depth buffers
+			EDepthCompare depthCompare;	// of the depth buffer
+		};
+
 		/// <summary>
 		/// Executes a fragment shader which result should be write to FinalColor
 		/// </summary>
 		/// <returns> False if fragment should be discarded, true otherwise. </returns>
 		virtual bool fragment() = 0;
 
+		// creates a copy of the shader with all its settings so it can be run on a different thread
+		virtual std::unique_ptr<IFragmentShader> Clone() const = 0;
+
+		// Shades a whole span at once. The default one steps the interpolated values from pixel to pixel and runs fragment()
+		// for every pixel, testing and writing the depth before or after it as GetDepthTestStage() allows. Shaders can
+		// override it to step their own data too. Returns whether any depth was written.
+		virtual bool ShadeSpan(const FragmentSpan& span, Texture& colorTarget);
+
+		// shaders that discard fragments or write their depth have to say so, otherwise the depth is tested early
+		virtual EFragmentShaderFlags GetFlags() const { return EFragmentShaderFlags::NONE; }
+		EDepthTestStage GetDepthTestStage() const
+		{
+			const EFragmentShaderFlags flags = GetFlags();
+			if ((flags & EFragmentShaderFlags::WRITES_DEPTH) != EFragmentShaderFlags::NONE)
+				return EDepthTestStage::LATE;
+			if ((flags & EFragmentShaderFlags::DISCARDS) != EFragmentShaderFlags::NONE)
+				return EDepthTestStage::EARLY_TEST_LATE_WRITE;
+			return EDepthTestStage::EARLY;
+		}
+
+		// Change of the barycentric coordinates from one pixel to the next in x and y. Set once per triangle for shaders
+		// with EFragmentShaderFlags::USES_DERIVATIVES, the same for all its fragments.
+		void SetBarycentricDerivatives(const Vec3f& ddx, const Vec3f& ddy) { m_BarycentricDdx = ddx; m_BarycentricDdy = ddy; }
+
+		// interpolated depth of the fragment, set before fragment() is run
+		void SetFragmentDepth(float depth) { m_FragmentDepth = depth; }
+		float GetFragmentDepth() const { return m_FragmentDepth; }
+
 		const Vec4f& GetFinalColor() const { return m_FinalColor; }
 
 		void SetAlbedoTexture(TGAImage* albedoTexture) { m_AlbedoTexture = albedoTexture; }
@@ -67,6 +178,9 @@ namespace sor
 	protected:
 		Vec4f m_FinalColor;
 		InterpolationData m_InterpolationData;
+		float m_FragmentDepth{ 0.f };		// shaders with EFragmentShaderFlags::WRITES_DEPTH can change it in fragment()
+		Vec3f m_BarycentricDdx;
+		Vec3f m_BarycentricDdy;
 		TGAImage* m_AlbedoTexture{ nullptr };
 		TGAImage* m_NormalTexture{ nullptr };
 		TGAImage* m_SpecularTexture{ nullptr };
@@ -81,24 +195,19 @@ namespace sor
 		Vec4f GetVaryingData4(i32 dataHash, u8 vertIndex) const;
 
 		template<typename TDataType>
-		TDataType GetVaryingData(i32 dataHash, const VaryingDataContainer<TDataType>& container, u8 vertIndex) const
+		TDataType GetVaryingData(i32 dataHash, u8 vertIndex) const
 		{
-			assert(container.contains(dataHash));
 			assert(vertIndex < 3);
 
-			const auto& vertexData = container.at(dataHash);
-			return vertexData[vertIndex];
+			return m_VaryingData[vertIndex].Get<TDataType>(dataHash);
 		}
 
 		template<typename TDataType>
-		TDataType GetInterpolatedData(i32 dataHash, const VaryingDataContainer<TDataType>& container) const
+		TDataType GetInterpolatedData(i32 dataHash) const
 		{
-			assert(container.contains(dataHash));
-
-			const auto& vertexData = container.at(dataHash);
-			const TDataType& data1 = vertexData.at(0);
-			const TDataType& data2 = vertexData.at(1);
-			const TDataType& data3 = vertexData.at(2);
+			const TDataType& data1 = m_VaryingData[0].Get<TDataType>(dataHash);
+			const TDataType& data2 = m_VaryingData[1].Get<TDataType>(dataHash);
+			const TDataType& data3 = m_VaryingData[2].Get<TDataType>(dataHash);
 
 			// const TDataType dividedData1 = data1 * (1.f / m_InterpolationData.verticesW.raw[0]);
 			// const TDataType dividedData2 = data2 * (1.f / m_InterpolationData.verticesW.raw[1]);
@@ -112,48 +221,79 @@ namespace sor
 				data3 * m_InterpolationData.barycentricCoordinates.z;
 		}
 
+		// Screen space derivatives of the interpolated data, how much it changes from one pixel to the next.
+		// Only valid for shaders with EFragmentShaderFlags::USES_DERIVATIVES.
+		template<typename TDataType>
+		TDataType GetInterpolatedDataDdx(i32 dataHash) const
+		{
+			return m_VaryingData[0].Get<TDataType>(dataHash) * m_BarycentricDdx.x + m_VaryingData[1].Get<TDataType>(dataHash) * m_BarycentricDdx.y
+				+ m_VaryingData[2].Get<TDataType>(dataHash) * m_BarycentricDdx.z;
+		}
+
+		template<typename TDataType>
+		TDataType GetInterpolatedDataDdy(i32 dataHash) const
+		{
+			return m_VaryingData[0].Get<TDataType>(dataHash) * m_BarycentricDdy.x + m_VaryingData[1].Get<TDataType>(dataHash) * m_BarycentricDdy.y
+				+ m_VaryingData[2].Get<TDataType>(dataHash) * m_BarycentricDdy.z;
+		}
+
 	};
 
+	// most unique vertices the vertex shader is given at once
+	constexpr int VERTEX_BATCH_SIZE = 256;
+
 	//--------------------------------------------------------------------------------------------------
 	class IVertexShader : virtual public IShaderBase
 	{
 	public:
-		// vertex shared returns the coordinates in clip space before perspective divide
-		virtual Vec4f vertex(u32 faceIdx, u8 vertIdx) = 0;
+		// Unique vertices [first, first + count) of the model (at most VERTEX_BATCH_SIZE of them) at once. Writes the
+		// positions in clip space before the perspective divide as separate arrays of x, y, z and w and the varying data
+		// of every vertex. Batches are run on several threads at once so they can only write the outputs they are given,
+		// never the state of the shader.
+		virtual void VertexBatch(int first, int count, const std::array<float*, 4>& positions, VertexVaryingData* varyingData) const = 0;
+		// the same positions without writing any varying data
+		virtual void PositionBatch(int first, int count, const std::array<float*, 4>& positions) const = 0;
 
 		void SetModel(Model* model) { m_Model = model; }
 
 	protected:
 		Model* m_Model{ nullptr };
-
-		void SetVaryingData4(i32 hash, u8 vertexIdx, const Vec4f& data);
-		void SetVaryingData3(i32 hash, u8 vertexIdx, const Vec3f& data);
-		void SetVaryingData2(i32 hash, u8 vertexIdx, const Vec2f& data);
-		void SetVaryingData1(i32 hash, u8 vertexIdx, const float& data);
-
-		template<typename DataType>
-		void SetVaryingData(i32 hash, u8 vertexIdx, const DataType& data, VaryingDataContainer<DataType>& container)
-		{
-			if (!container.contains(hash))
-				container.emplace(hash, VertexDataContainer<DataType>{});
-
-			container.at(hash)[vertexIdx] = data;
-		}
-
 	};
 
 	//--------------------------------------------------------------------------------------------------
 	class BasicScreenSpace : public IVertexShader
 	{
 	public:
-		Vec4f vertex(u32 faceIdx, u8 vertIdx) override;
+		void VertexBatch(int first, int count, const std::array<float*, 4>& positions, VertexVaryingData* varyingData) const override;
+		void PositionBatch(int first, int count, const std::array<float*, 4>& positions) const override;
 	};
 
 	//--------------------------------------------------------------------------------------------------
 	class BasicScreenSpaceWithNormals : public BasicScreenSpace
 	{
 	public:
-		Vec4f vertex(u32 faceIdx, u8 vertIdx) override;
+		void VertexBatch(int first, int count, const std::array<float*, 4>& positions, VertexVaryingData* varyingData) const override;
+	};
+
+	//--------------------------------------------------------------------------------------------------
+	// Depth prepass, only the depth is rasterized. Keeps the flags of the shader for the shading pass that pick how the
+	// triangles are rasterized so the depth is interpolated the same way, bit for bit, and the shading pass can test it
+	// with EDepthCompare::EQUAL. Spans step the depth the same way the default ShadeSpan() does.
+	class DepthOnlyShader : public IFragmentShader
+	{
+	public:
+		explicit DepthOnlyShader(EFragmentShaderFlags shadingFlags)
+			: m_Flags(EFragmentShaderFlags::DEPTH_ONLY
+				| (shadingFlags & EFragmentShaderFlags::SPANS_ONLY)) {
+		}
+
+		bool fragment() override;
+		std::unique_ptr<IFragmentShader> Clone() const override { return std::make_unique<DepthOnlyShader>(*this); }
+		bool ShadeSpan(const FragmentSpan& span, Texture& colorTarget) override;
+		EFragmentShaderFlags GetFlags() const override { return m_Flags; }
+
+	private:
+		EFragmentShaderFlags m_Flags;
 	};
 
 	//--------------------------------------------------------------------------------------------------
@@ -161,6 +301,8 @@ namespace sor
 	{
 	public:
 		bool fragment() override;
+		// the albedo texture is sampled from the mip the uv derivatives pick
+		EFragmentShaderFlags GetFlags() const override { return EFragmentShaderFlags::USES_DERIVATIVES; }
 	};
 
 	//--------------------------------------------------------------------------------------------------
@@ -168,6 +310,8 @@ namespace sor
 	{
 	public:
 		bool fragment() override;
+		// the albedo texture is sampled from the mip the uv derivatives pick
+		EFragmentShaderFlags GetFlags() const override { return EFragmentShaderFlags::USES_DERIVATIVES; }
 	};
 
 	//--------------------------------------------------------------------------------------------------
@@ -196,6 +340,8 @@ namespace sor
 		}
 
 		bool fragment() override;
+		// the textures are sampled from the mips the uv derivatives pick
+		EFragmentShaderFlags GetFlags() const override { return EFragmentShaderFlags::USES_DERIVATIVES; }
 
 		float m_shininess;
 	};
@@ -207,13 +353,23 @@ namespace sor
 		NormalMappedPhongShader(float shininess)
 			: NormalMappedPhongFragmentShader(shininess) {
 		}
+
+		std::unique_ptr<IFragmentShader> Clone() const override { return std::make_unique<NormalMappedPhongShader>(*this); }
 	};
 
 	//--------------------------------------------------------------------------------------------------
-	class BasicPhongShader : public BasicScreenSpaceWithNormals, public Phong {};
+	class BasicPhongShader : public BasicScreenSpaceWithNormals, public Phong
+	{
+	public:
+		std::unique_ptr<IFragmentShader> Clone() const override { return std::make_unique<BasicPhongShader>(*this); }
+	};
 
 	//--------------------------------------------------------------------------------------------------
-	class FlatColorShader : public BasicScreenSpace, public FlatColorFragmentShader {};
+	class FlatColorShader : public BasicScreenSpace, public FlatColorFragmentShader
+	{
+	public:
+		std::unique_ptr<IFragmentShader> Clone() const override { return std::make_unique<FlatColorShader>(*this); }
+	};
 
 	//--------------------------------------------------------------------------------------------------
 	class QuantizeShadar : public BasicScreenSpaceWithNormals, public QuantizeFragmentShader
@@ -222,5 +378,7 @@ namespace sor
 		QuantizeShadar(const Vec3f& tint, int levels)
 			: QuantizeFragmentShader(tint, levels) {
 		}
+
+		std::unique_ptr<IFragmentShader> Clone() const override { return std::make_unique<QuantizeShadar>(*this); }
 	};
 }
@@ -1,5 +1,8 @@
 #include "texture.h"
 
+#include <algorithm>
+#include <cassert>
+
 namespace sor
 {
 	//--------------------------------------------------------------------------------------------------
@@ -61,6 +64,37 @@ namespace sor
 		memset(m_pData, 0, m_Height * m_Width * (int) m_TextureFormat);
 	}
 
+	//--------------------------------------------------------------------------------------------------
+	void Texture::Blit(const Texture& source, int x, int y)
+	{
+		assert(m_TextureFormat == source.m_TextureFormat);
+
+		const int srcStartX = std::max(0, -x);
+		const int srcStartY = std::max(0, -y);
+		const int srcEndX = std::min(source.m_Width, m_Width - x);
+		const int srcEndY = std::min(source.m_Height, m_Height - y);
+		if (!m_pData || !source.m_pData || srcStartX >= srcEndX || srcStartY >= srcEndY)
+			return;
+
+		const int bytesPerPixel = (int)m_TextureFormat;
+		const int rowBytes = (srcEndX - srcStartX) * bytesPerPixel;
+		for (int srcY = srcStartY; srcY < srcEndY; srcY++)
+		{
+			memcpy(m_pData + (x + srcStartX + (y + srcY) * m_Width) * bytesPerPixel,
+				source.m_pData + (srcStartX + srcY * source.m_Width) * bytesPerPixel, rowBytes);
+		}
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void Texture::CopyPixels(const Texture& source, int x, int y, int count)
+	{
+		assert(m_TextureFormat == source.m_TextureFormat && m_Width == source.m_Width && m_Height == source.m_Height);
+		assert(x >= 0 && y >= 0 && x + count <= m_Width && y < m_Height);
+
+		const int offset = (x + y * m_Width) * (int)m_TextureFormat;
+		memcpy(m_pData + offset, source.m_pData + offset, count * (int)m_TextureFormat);
+	}
+
 	//--------------------------------------------------------------------------------------------------
 	void Texture::SetPixel(int x, int y, TGAColor c)
 	{
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cassert>
+#include <cstring>
 #include <iostream>
 
 #include "TGAColor.h"
@@ -35,7 +37,20 @@ namespace sor
 
 		void Clear();
 
+		// copies the whole source texture so its pixel (0, 0) lands at (x, y) of this texture, whatever ends up outside
+		// of either texture is skipped. Both textures have to have the same format.
+		void Blit(const Texture& source, int x, int y);
+		// copies count pixels of the row starting at (x, y) from the same place of the source, which has to be of the
+		// same size and format
+		void CopyPixels(const Texture& source, int x, int y, int count);
+
 		void SetPixel(int x, int y, TGAColor c);
+		// for inner loops that already made sure the pixel is inside of the texture
+		void SetPixelUnchecked(int x, int y, const TGAColor& c)
+		{
+			assert(m_pData && x >= 0 && y >= 0 && x < m_Width && y < m_Height);
+			memcpy(m_pData + (x + y * m_Width) * (int) m_TextureFormat, c.raw, (int) m_TextureFormat);
+		}
 		TGAColor GetPixel(int x, int y) const;
 		const unsigned char* GetBuffer() const { return m_pData; }
 
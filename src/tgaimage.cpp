@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <string.h>
@@ -9,6 +10,7 @@
 namespace sor
 {
 	bool TGAImage::read_tga_file(const char* filename) {
+		mips.clear();
 		if (texture.m_pData) delete[] texture.m_pData;
 		texture.m_pData = nullptr;
 		std::ifstream in;
@@ -291,6 +293,67 @@ namespace sor
 		memset((void*)texture.m_pData, 0, texture.m_Width * texture.m_Height * (int) texture.m_TextureFormat);
 	}
 
+	void TGAImage::GenerateMips()
+	{
+		mips.clear();
+		if (!texture.m_pData)
+			return;
+
+		const int bytespp = (int) texture.m_TextureFormat;
+		const Texture* source = &texture;
+		while (source->GetWidth() > 1 || source->GetHeight() > 1)
+		{
+			Texture mip{ std::max(source->GetWidth() / 2, 1), std::max(source->GetHeight() / 2, 1), texture.m_TextureFormat };
+			for (int y = 0; y < mip.GetHeight(); y++)
+			{
+				// an odd last row or column is averaged with itself
+				const int sourceY[2]{ 2 * y, std::min(2 * y + 1, source->GetHeight() - 1) };
+				for (int x = 0; x < mip.GetWidth(); x++)
+				{
+					const int sourceX[2]{ 2 * x, std::min(2 * x + 1, source->GetWidth() - 1) };
+					int sums[4]{};
+					for (const int sy : sourceY)
+					{
+						for (const int sx : sourceX)
+						{
+							const TGAColor c = source->GetPixel(sx, sy);
+							for (int i = 0; i < bytespp; i++)
+								sums[i] += c.raw[i];
+						}
+					}
+
+					unsigned char average[4]{};
+					for (int i = 0; i < bytespp; i++)
+						average[i] = static_cast<unsigned char>((sums[i] + 2) / 4);
+					mip.SetPixel(x, y, TGAColor(average, bytespp));
+				}
+			}
+
+			mips.push_back(std::move(mip));
+			source = &mips.back();
+		}
+	}
+
+	TGAColor TGAImage::Sample(const Vec2f& uv, const Vec2f& uvDdx, const Vec2f& uvDdy) const
+	{
+		// the level where the bigger of the two derivatives is about one pixel long
+		const float width = static_cast<float>(texture.m_Width);
+		const float height = static_cast<float>(texture.m_Height);
+		const Vec2f pixelsDdx{ uvDdx.u * width, uvDdx.v * height };
+		const Vec2f pixelsDdy{ uvDdy.u * width, uvDdy.v * height };
+		const float lengthSquared = std::max(pixelsDdx.u * pixelsDdx.u + pixelsDdx.v * pixelsDdx.v,
+			pixelsDdy.u * pixelsDdy.u + pixelsDdy.v * pixelsDdy.v);
+		const float lod = 0.5f * std::log2(lengthSquared);
+
+		// NaN derivatives sample the image itself too
+		if (!(lod > 0.5f) || mips.empty())
+			return get(static_cast<int>(width * uv.u), static_cast<int>(height * uv.v));
+
+		const Texture& mip = mips[static_cast<int>(std::min(lod + 0.5f, static_cast<float>(mips.size()))) - 1];
+		return mip.GetPixel(static_cast<int>(static_cast<float>(mip.GetWidth()) * uv.u),
+			static_cast<int>(static_cast<float>(mip.GetHeight()) * uv.v));
+	}
+
 	Vec3i ConvertModelCoordsIntoImageCoords(const Vec3f& vert, float scale, const int width, const int height, const int farPlane)
 	{
 		return Vec3i
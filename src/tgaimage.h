@@ -2,6 +2,7 @@
 #define __IMAGE_H__
 
 #include <fstream>
+#include <vector>
 
 #include "geometry.h"
 #include "texture.h"
@@ -29,6 +30,8 @@ namespace sor
 	class TGAImage {
 	protected:
 		Texture texture;
+		// each half the size of the one before, down to 1x1
+		std::vector<Texture> mips;
 		bool   load_rle_data(std::ifstream& in);
 		bool unload_rle_data(std::ofstream& out);
 	public:
@@ -50,6 +53,13 @@ namespace sor
 		unsigned char* buffer();
 		Texture& GetTexture();
 		void clear();
+
+		// Builds the mips from the current pixels by averaging every 2x2 of them, they have to be built again after
+		// the pixels change.
+		void GenerateMips();
+		// Nearest pixel at uv of the mip picked by how much uv changes from one screen pixel to the next in x and y. Only
+		// the image itself is sampled without mips, with what get() gives for the same uv.
+		TGAColor Sample(const Vec2f& uv, const Vec2f& uvDdx, const Vec2f& uvDdy) const;
 	};
 
 	Vec3i ConvertModelCoordsIntoImageCoords(const Vec3f& vert, float scale, const int width, const int height, const int farPlane);
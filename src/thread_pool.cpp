@@ -0,0 +1,88 @@
+#include "thread_pool.h"
+
+namespace sor
+{
+	//--------------------------------------------------------------------------------------------------
+	ThreadPool::ThreadPool(int workerCount)
+	{
+		// the calling thread is one of the workers
+		for (int i = 1; i < workerCount; i++)
+			m_Threads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard lock(m_Mutex);
+			m_Quit = true;
+		}
+		m_WorkAvailable.notify_all();
+
+		for (std::thread& thread : m_Threads)
+			thread.join();
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void ThreadPool::ParallelFor(int taskCount, const TaskFunc& func)
+	{
+		if (taskCount <= 0)
+			return;
+
+		if (m_Threads.empty() || taskCount == 1)
+		{
+			for (int i = 0; i < taskCount; i++)
+				func(i, 0);
+
+			return;
+		}
+
+		{
+			std::lock_guard lock(m_Mutex);
+			m_pTaskFunc = &func;
+			m_TaskCount = taskCount;
+			m_NextTask = 0;
+			m_BusyThreads = static_cast<int>(m_Threads.size());
+			m_Generation++;
+		}
+		m_WorkAvailable.notify_all();
+
+		RunTasks(0);
+
+		std::unique_lock lock(m_Mutex);
+		m_WorkDone.wait(lock, [this]() { return m_BusyThreads == 0; });
+		m_pTaskFunc = nullptr;
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void ThreadPool::WorkerLoop(int workerIdx)
+	{
+		u64 lastGeneration = 0;
+		while (true)
+		{
+			{
+				std::unique_lock lock(m_Mutex);
+				m_WorkAvailable.wait(lock, [this, lastGeneration]() { return m_Quit || m_Generation != lastGeneration; });
+				if (m_Quit)
+					return;
+
+				lastGeneration = m_Generation;
+			}
+
+			RunTasks(workerIdx);
+
+			{
+				std::lock_guard lock(m_Mutex);
+				if (--m_BusyThreads == 0)
+					m_WorkDone.notify_one();
+			}
+		}
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void ThreadPool::RunTasks(int workerIdx)
+	{
+		for (int taskIdx = m_NextTask++; taskIdx < m_TaskCount; taskIdx = m_NextTask++)
+			(*m_pTaskFunc)(taskIdx, workerIdx);
+	}
+}
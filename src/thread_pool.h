@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "types.h"
+
+namespace sor
+{
+	// Pool of persistent worker threads that execute parallel for loops. The calling thread takes part in the work
+	// as well and always gets worker index 0, so there are GetWorkerCount() - 1 threads in the pool itself.
+	class ThreadPool
+	{
+	public:
+		using TaskFunc = std::function<void(int taskIdx, int workerIdx)>;
+
+		explicit ThreadPool(int workerCount = static_cast<int>(std::thread::hardware_concurrency()));
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		int GetWorkerCount() const { return static_cast<int>(m_Threads.size()) + 1; }
+
+		// Calls func for every task index in [0, taskCount) and returns once all of them have finished. Tasks are handed
+		// out dynamically so the order they run in isn't defined. Can't be called from inside of a task.
+		void ParallelFor(int taskCount, const TaskFunc& func);
+
+	private:
+		void WorkerLoop(int workerIdx);
+		void RunTasks(int workerIdx);
+
+		std::vector<std::thread> m_Threads;
+
+		std::mutex m_Mutex;
+		std::condition_variable m_WorkAvailable;
+		std::condition_variable m_WorkDone;
+
+		const TaskFunc* m_pTaskFunc{ nullptr };
+		int m_TaskCount{ 0 };
+		std::atomic<int> m_NextTask{ 0 };
+		int m_BusyThreads{ 0 };
+		u64 m_Generation{ 0 };	// incremented for every ParallelFor so the threads know there's new work
+		bool m_Quit{ false };
+	};
+
+	inline ThreadPool& GetThreadPool()
+	{
+		static ThreadPool threadPool;
+		return threadPool;
+	}
+}
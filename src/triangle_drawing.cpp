@@ -1,6 +1,9 @@
 #include "triangle_drawing.h"
 
+#include <limits>
+
 #include "triangle_drawing_test.h"
+#include "raster_kernels.h"
 
 namespace sor
 {
@@ -286,6 +289,406 @@ namespace sor
 		}
 	}
 
+	bool SetupTriangle(const Triangle& t, const Vec2i& outputSize, TriangleSetup& setup)
+	{
+		std::array perspDivVerts{ t.v0ss.FromHomogeneous(), t.v1ss.FromHomogeneous(), t.v2ss.FromHomogeneous()};
+
+		// snap the vertices to the subpixel grid, the integer setup can't represent vertices too far off the screen
+		std::array<Vec2<i64>, 3> v;
+		for (int i = 0; i < 3; i++)
+		{
+			if (!(std::abs(perspDivVerts[i].x) < MAX_RASTER_COORDINATE && std::abs(perspDivVerts[i].y) < MAX_RASTER_COORDINATE))
+				return false;
+
+			v[i] = { SnapToSubpixel(perspDivVerts[i].x), SnapToSubpixel(perspDivVerts[i].y) };
+		}
+
+		// tiny triangles that don't contain any pixel center are dropped right here, before the more expensive edge setup
+		setup.bboxMin = {
+			static_cast<int>(std::max<i64>(GetFirstPixelInside(std::min({ v[0].x, v[1].x, v[2].x })), 0)),
+			static_cast<int>(std::max<i64>(GetFirstPixelInside(std::min({ v[0].y, v[1].y, v[2].y })), 0)) };
+		setup.bboxMax = {
+			static_cast<int>(std::min<i64>(GetLastPixelInside(std::max({ v[0].x, v[1].x, v[2].x })), outputSize.x - 1)),
+			static_cast<int>(std::min<i64>(GetLastPixelInside(std::max({ v[0].y, v[1].y, v[2].y })), outputSize.y - 1)) };
+
+		if (setup.bboxMin.x > setup.bboxMax.x || setup.bboxMin.y > setup.bboxMax.y)
+			return false;
+
+		setup.doubleArea = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].x - v[0].x);
+		if (setup.doubleArea == 0)
+			return false;
+
+		// the edge opposite to vertex i goes from vertex j to vertex k
+		const i64 orientation = setup.doubleArea > 0 ? 1 : -1;
+		for (int i = 0; i < 3; i++)
+			setup.edges[i] = SetupEdgeFunction(v[(i + 1) % 3], v[(i + 2) % 3], orientation);
+
+		setup.doubleArea *= orientation;
+		setup.oneOverDoubleArea = 1.f / static_cast<float>(setup.doubleArea);
+
+		setup.vertsZ = Vec3f{ perspDivVerts[0].z, perspDivVerts[1].z, perspDivVerts[2].z };
+		setup.depthMargin = GetDepthMargin(setup.vertsZ);
+		setup.nearestDepth = GetNearestDepth(setup.vertsZ, setup.doubleArea, setup.depthMargin);
+		setup.vertsW = Vec3f{ t.v0ss.w(), t.v1ss.w(), t.v2ss.w() };
+		setup.vertsOneOverW = Vec3f{ 1.f / t.v0ss.w(), 1.f / t.v1ss.w(), 1.f / t.v2ss.w() };
+
+		return true;
+	}
+
+	namespace
+	{
+		enum class EBlockCoverage : u8
+		{
+			EMPTY,
+			PARTIAL,
+			FULL
+		};
+
+		// edge functions are linear so it's enough to check the corner of the block where each of them is the smallest/largest
+		EBlockCoverage ClassifyBlock(const TriangleSetup& setup, const std::array<i64, 3>& blockEdgeValues, int blockWidth, int blockHeight)
+		{
+			bool fullyCovered = true;
+			for (int i = 0; i < 3; i++)
+			{
+				const EdgeFunction& edge = setup.edges[i];
+				const i64 stepX = edge.a * (blockWidth - 1);
+				const i64 stepY = edge.b * (blockHeight - 1);
+
+				if (blockEdgeValues[i] + std::max<i64>(stepX, 0) + std::max<i64>(stepY, 0) < 0)
+					return EBlockCoverage::EMPTY;
+
+				if (blockEdgeValues[i] + std::min<i64>(stepX, 0) + std::min<i64>(stepY, 0) < 0)
+					fullyCovered = false;
+			}
+
+			return fullyCovered ? EBlockCoverage::FULL : EBlockCoverage::PARTIAL;
+		}
+
+		// for all hierarchical z-buffer tiles overlapping the area given relative to the target, both corners inclusive
+		void UpdateFarthestDepth(ZBufferBase& depthTarget, const Vec2i& min, const Vec2i& max)
+		{
+			for (int tileY = min.y / HI_Z_TILE_SIZE; tileY <= max.y / HI_Z_TILE_SIZE; tileY++)
+			{
+				for (int tileX = min.x / HI_Z_TILE_SIZE; tileX <= max.x / HI_Z_TILE_SIZE; tileX++)
+					depthTarget.UpdateFarthestDepth(tileX, tileY);
+			}
+		}
+
+		// rounds towards negative infinity unlike the division operator
+		i64 FloorDiv(i64 numerator, i64 denominator)
+		{
+			assert(denominator > 0);
+			const i64 quotient = numerator / denominator;
+			return (numerator % denominator != 0 && numerator < 0) ? quotient - 1 : quotient;
+		}
+
+		struct BlockRasterContext
+		{
+			const TriangleSetup& setup;
+			RasterRowFunc rasterizeRow;
+			Vec2i rasterMax;					// last pixel that can be rasterized, inclusive
+			Vec2i targetOrigin;
+			Texture& colorTarget;
+			ZBufferBase& depthTarget;
+			IFragmentShader& fragmentShader;
+
+			bool testHiZ;						// not possible if the fragment shader can change the depth
+			float depthStepX;					// change of the depth of the triangle plane from one pixel to the next
+			float depthStepY;
+		};
+
+		// Rasterizes block of at most RASTER_BLOCK_SIZE, blockPos is aligned to the tiles of the hierarchical z-buffer
+		// relative to the target so the block is skipped if the triangle is behind everything in the tile.
+		void RasterizeRasterBlock(const BlockRasterContext& context, const Vec2i& blockPos, int blockWidth, int blockHeight,
+			const std::array<i64, 3>& blockEdgeValues, bool fullyCovered)
+		{
+			const TriangleSetup& setup = context.setup;
+			const int tileX = (blockPos.x - context.targetOrigin.x) / HI_Z_TILE_SIZE;
+			const int tileY = (blockPos.y - context.targetOrigin.y) / HI_Z_TILE_SIZE;
+
+			if (context.testHiZ)
+			{
+				// depth is linear in screen space so the plane of the triangle is the closest in one of the block corners
+				const float cornerDepth = setup.vertsZ.dot(Vec3f{
+					static_cast<float>(blockEdgeValues[0]) * setup.oneOverDoubleArea,
+					static_cast<float>(blockEdgeValues[1]) * setup.oneOverDoubleArea,
+					static_cast<float>(blockEdgeValues[2]) * setup.oneOverDoubleArea });
+				const float nearestPlaneDepth = cornerDepth + std::min(context.depthStepX * (blockWidth - 1), 0.f)
+					+ std::min(context.depthStepY * (blockHeight - 1), 0.f) - setup.depthMargin;
+
+				if (std::max(nearestPlaneDepth, setup.nearestDepth) >= context.depthTarget.GetFarthestDepth(tileX, tileY))
+					return;
+			}
+
+			std::array<i64, 3> rowEdgeValues = blockEdgeValues;
+			for (int y = blockPos.y; y < blockPos.y + blockHeight; y++)
+			{
+				context.rasterizeRow(setup, { { blockPos.x - context.targetOrigin.x, y - context.targetOrigin.y }, blockWidth,
+					rowEdgeValues, fullyCovered }, context.colorTarget, context.depthTarget, context.fragmentShader);
+
+				for (int i = 0; i < 3; i++)
+					rowEdgeValues[i] += setup.edges[i].b;
+			}
+
+			context.depthTarget.UpdateFarthestDepth(tileX, tileY);
+		}
+
+		// Skips the block if it's empty, rasterizes it without inside tests if it's fully covered and splits it into
+		// quarters if it's only partially covered. Blocks of RASTER_BLOCK_SIZE aren't split any further, their pixels are
+		// tested one by one. Parts of the block past rasterMax are ignored. Fully covered blocks are still walked in
+		// RASTER_BLOCK_SIZE blocks so each of them can be tested against the hierarchical z-buffer.
+		void RasterizeBlock(const BlockRasterContext& context, const Vec2i& blockPos, int blockSize, const std::array<i64, 3>& blockEdgeValues)
+		{
+			const std::array<EdgeFunction, 3>& edges = context.setup.edges;
+			const int blockWidth = std::min(blockSize, context.rasterMax.x - blockPos.x + 1);
+			const int blockHeight = std::min(blockSize, context.rasterMax.y - blockPos.y + 1);
+
+			const EBlockCoverage coverage = ClassifyBlock(context.setup, blockEdgeValues, blockWidth, blockHeight);
+			if (coverage == EBlockCoverage::EMPTY)
+				return;
+
+			if (blockSize == RASTER_BLOCK_SIZE)
+			{
+				RasterizeRasterBlock(context, blockPos, blockWidth, blockHeight, blockEdgeValues, coverage == EBlockCoverage::FULL);
+				return;
+			}
+
+			if (coverage == EBlockCoverage::PARTIAL)
+			{
+				const int subBlockSize = blockSize / 2;
+				for (int subBlockY = blockPos.y; subBlockY < blockPos.y + blockHeight; subBlockY += subBlockSize)
+				{
+					for (int subBlockX = blockPos.x; subBlockX < blockPos.x + blockWidth; subBlockX += subBlockSize)
+					{
+						const i64 offsetX = subBlockX - blockPos.x;
+						const i64 offsetY = subBlockY - blockPos.y;
+						const std::array<i64, 3> subBlockEdgeValues{
+							blockEdgeValues[0] + edges[0].a * offsetX + edges[0].b * offsetY,
+							blockEdgeValues[1] + edges[1].a * offsetX + edges[1].b * offsetY,
+							blockEdgeValues[2] + edges[2].a * offsetX + edges[2].b * offsetY };
+
+						RasterizeBlock(context, { subBlockX, subBlockY }, subBlockSize, subBlockEdgeValues);
+					}
+				}
+				return;
+			}
+
+			std::array<i64, 3> rasterBlockRowEdgeValues = blockEdgeValues;
+			for (int rasterBlockY = blockPos.y; rasterBlockY < blockPos.y + blockHeight; rasterBlockY += RASTER_BLOCK_SIZE)
+			{
+				std::array<i64, 3> rasterBlockEdgeValues = rasterBlockRowEdgeValues;
+				for (int rasterBlockX = blockPos.x; rasterBlockX < blockPos.x + blockWidth; rasterBlockX += RASTER_BLOCK_SIZE)
+				{
+					RasterizeRasterBlock(context, { rasterBlockX, rasterBlockY },
+						std::min(RASTER_BLOCK_SIZE, blockPos.x + blockWidth - rasterBlockX),
+						std::min(RASTER_BLOCK_SIZE, blockPos.y + blockHeight - rasterBlockY), rasterBlockEdgeValues, true);
+
+					for (int i = 0; i < 3; i++)
+						rasterBlockEdgeValues[i] += edges[i].a * RASTER_BLOCK_SIZE;
+				}
+
+				for (int i = 0; i < 3; i++)
+					rasterBlockRowEdgeValues[i] += edges[i].b * RASTER_BLOCK_SIZE;
+			}
+		}
+	}
+
+	void DrawTriangle_EdgeFunction(const Triangle& t, Texture& outputTex, ZBufferBase& zBuffer, IFragmentShader& fragmentShader)
+	{
+		TriangleSetup setup;
+		if (!SetupTriangle(t, { outputTex.GetWidth(), outputTex.GetHeight() }, setup))
+			return;
+
+		RasterizeTriangle(setup, outputTex, zBuffer, { 0, 0 }, fragmentShader);
+	}
+
+	void RasterizeTriangle(const TriangleSetup& setup, Texture& colorTarget, ZBufferBase& depthTarget, const Vec2i& targetOrigin,
+		IFragmentShader& fragmentShader)
+	{
+		const Vec2i rasterMin{ std::max(setup.bboxMin.x, targetOrigin.x), std::max(setup.bboxMin.y, targetOrigin.y) };
+		const Vec2i rasterMax{ std::min(setup.bboxMax.x, targetOrigin.x + colorTarget.GetWidth() - 1),
+			std::min(setup.bboxMax.y, targetOrigin.y + colorTarget.GetHeight() - 1) };
+
+		if (rasterMin.x > rasterMax.x || rasterMin.y > rasterMax.y)
+			return;
+
+		// whole triangle behind what's already drawn
+		const bool testHiZ = fragmentShader.GetDepthTestStage() != EDepthTestStage::LATE;
+		if (testHiZ && depthTarget.IsOccluded(rasterMin - targetOrigin, rasterMax - targetOrigin, setup.nearestDepth))
+			return;
+
+		const EFragmentShaderFlags shaderFlags = fragmentShader.GetFlags();
+		const std::array<EdgeFunction, 3>& edges = setup.edges;
+
+		if ((shaderFlags & EFragmentShaderFlags::USES_DERIVATIVES) != EFragmentShaderFlags::NONE)
+			SetBarycentricDerivatives(setup, fragmentShader);
+
+		const ERasterPath rasterPath = GetRasterPath(setup, shaderFlags, depthTarget);
+		if (rasterPath == ERasterPath::SMALL_TRIANGLE)
+		{
+			depthTarget.MarkWritten(rasterMin - targetOrigin, rasterMax - targetOrigin);
+
+			const RasterFootprint footprint{ rasterMin - targetOrigin, rasterMax.x - rasterMin.x + 1, rasterMax.y - rasterMin.y + 1,
+				{ edges[0].Evaluate(rasterMin.x, rasterMin.y), edges[1].Evaluate(rasterMin.x, rasterMin.y), edges[2].Evaluate(rasterMin.x, rasterMin.y) } };
+			if (RasterizeSmallTriangle(setup, footprint, colorTarget, depthTarget, fragmentShader))
+				UpdateFarthestDepth(depthTarget, rasterMin - targetOrigin, rasterMax - targetOrigin);
+			return;
+		}
+
+		if (rasterPath == ERasterPath::SPANS)
+		{
+			RasterizeTriangle_Spans(setup, colorTarget, depthTarget, targetOrigin, fragmentShader);
+			return;
+		}
+
+		// blocks are aligned to the tiles of the hierarchical z-buffer, the pixels the alignment adds are outside of
+		// the bounding box so they're never covered
+		const Vec2i blocksMin{
+			rasterMin.x - (rasterMin.x - targetOrigin.x) % RASTER_BLOCK_SIZE,
+			rasterMin.y - (rasterMin.y - targetOrigin.y) % RASTER_BLOCK_SIZE };
+
+		// Wide kernels step the edge values in 32 bits. Edge functions are linear so they are the largest in the corners
+		// of the rasterized area, extended by the part of the last block the kernels may compute but never use.
+		bool edgeValuesFit32Bit = true;
+		for (const EdgeFunction& edge : edges)
+		{
+			for (int x : { blocksMin.x, rasterMax.x + RASTER_BLOCK_SIZE - 1 })
+			{
+				for (int y : { blocksMin.y, rasterMax.y })
+				{
+					const i64 value = edge.Evaluate(x, y);
+					if (value < std::numeric_limits<i32>::min() || value > std::numeric_limits<i32>::max())
+						edgeValuesFit32Bit = false;
+				}
+			}
+		}
+
+		// neither the kernels nor the fragments track what they write
+		depthTarget.MarkWritten(rasterMin - targetOrigin, rasterMax - targetOrigin);
+
+		const BlockRasterContext context{ setup, GetRasterRowFunc(edgeValuesFit32Bit, depthTarget, fragmentShader), rasterMax,
+			targetOrigin, colorTarget, depthTarget, fragmentShader, testHiZ,
+			setup.vertsZ.dot(Vec3f{ static_cast<float>(edges[0].a), static_cast<float>(edges[1].a), static_cast<float>(edges[2].a) })
+				* setup.oneOverDoubleArea,
+			setup.vertsZ.dot(Vec3f{ static_cast<float>(edges[0].b), static_cast<float>(edges[1].b), static_cast<float>(edges[2].b) })
+				* setup.oneOverDoubleArea };
+
+		// edge values at the bottom left corner of the current coarse block row
+		std::array<i64, 3> blockRowEdgeValues{
+			edges[0].Evaluate(blocksMin.x, blocksMin.y),
+			edges[1].Evaluate(blocksMin.x, blocksMin.y),
+			edges[2].Evaluate(blocksMin.x, blocksMin.y) };
+
+		for (int blockY = blocksMin.y; blockY <= rasterMax.y; blockY += RASTER_COARSE_BLOCK_SIZE)
+		{
+			std::array<i64, 3> blockEdgeValues = blockRowEdgeValues;
+
+			for (int blockX = blocksMin.x; blockX <= rasterMax.x; blockX += RASTER_COARSE_BLOCK_SIZE)
+			{
+				RasterizeBlock(context, { blockX, blockY }, RASTER_COARSE_BLOCK_SIZE, blockEdgeValues);
+
+				for (int i = 0; i < 3; i++)
+					blockEdgeValues[i] += edges[i].a * RASTER_COARSE_BLOCK_SIZE;
+			}
+
+			for (int i = 0; i < 3; i++)
+				blockRowEdgeValues[i] += edges[i].b * RASTER_COARSE_BLOCK_SIZE;
+		}
+	}
+
+	ERasterPath GetRasterPath(const TriangleSetup& setup, EFragmentShaderFlags shaderFlags, ZBufferBase& depthTarget)
+	{
+		// decided from the whole triangle, not just the part inside of the target, so all tiles of a triangle agree
+		const bool isSmall = setup.bboxMax.x - setup.bboxMin.x < SMALL_TRIANGLE_MAX_SIZE
+			&& setup.bboxMax.y - setup.bboxMin.y < SMALL_TRIANGLE_MAX_SIZE;
+		if (isSmall && (shaderFlags & EFragmentShaderFlags::SPANS_ONLY) == EFragmentShaderFlags::NONE)
+			return ERasterPath::SMALL_TRIANGLE;
+
+		const bool useSpans = RASTERIZER == ERasterizer::SPAN
+			|| (RASTERIZER == ERasterizer::AUTO && setup.bboxMax.x - setup.bboxMin.x < SPAN_RASTERIZER_MAX_WIDTH)
+			|| (shaderFlags & EFragmentShaderFlags::SPANS_ONLY) != EFragmentShaderFlags::NONE;
+		if (useSpans && depthTarget.GetFloatData() != nullptr)
+			return ERasterPath::SPANS;
+
+		return ERasterPath::BLOCKS;
+	}
+
+	void RasterizeTriangle_Spans(const TriangleSetup& setup, Texture& colorTarget, ZBufferBase& depthTarget, const Vec2i& targetOrigin,
+		IFragmentShader& fragmentShader)
+	{
+		float* depthData = depthTarget.GetFloatData();
+		assert(depthData != nullptr);
+		const int depthWidth = depthTarget.GetWidth();
+
+		const Vec2i rasterMin{ std::max(setup.bboxMin.x, targetOrigin.x), std::max(setup.bboxMin.y, targetOrigin.y) };
+		const Vec2i rasterMax{ std::min(setup.bboxMax.x, targetOrigin.x + colorTarget.GetWidth() - 1),
+			std::min(setup.bboxMax.y, targetOrigin.y + colorTarget.GetHeight() - 1) };
+
+		if (rasterMin.x > rasterMax.x || rasterMin.y > rasterMax.y)
+			return;
+
+		const std::array<EdgeFunction, 3>& edges = setup.edges;
+
+		depthTarget.MarkWritten(rasterMin - targetOrigin, rasterMax - targetOrigin);
+
+		// the values don't depend on the row or where the span starts, only the values of the first pixel do
+		const Vec3f barycentricCoordinatesStep{
+			static_cast<float>(edges[0].a) * setup.oneOverDoubleArea,
+			static_cast<float>(edges[1].a) * setup.oneOverDoubleArea,
+			static_cast<float>(edges[2].a) * setup.oneOverDoubleArea };
+		const float depthStep = setup.vertsZ.dot(barycentricCoordinatesStep);
+		const float oneOverWStep = setup.vertsOneOverW.dot(barycentricCoordinatesStep);
+
+		bool depthWritten = false;
+		for (int y = rasterMin.y; y <= rasterMax.y; y++)
+		{
+			// E(x, y) = a * x + E(0, y) >= 0 gives a lower bound on x for edges with positive a and an upper one for edges
+			// with negative a, edges with zero a either cover the whole row or nothing of it
+			i64 spanMin = rasterMin.x;
+			i64 spanMax = rasterMax.x;
+			for (const EdgeFunction& edge : edges)
+			{
+				const i64 valueAtRowStart = edge.b * y + edge.c;
+				if (edge.a > 0)
+					spanMin = std::max(spanMin, FloorDiv(-valueAtRowStart + edge.a - 1, edge.a));
+				else if (edge.a < 0)
+					spanMax = std::min(spanMax, FloorDiv(valueAtRowStart, -edge.a));
+				else if (valueAtRowStart < 0)
+					spanMax = spanMin - 1;
+			}
+
+			for (int x = static_cast<int>(spanMin); x <= spanMax; )
+			{
+				const int spanEnd = std::min(static_cast<int>(spanMax) + 1, (x / RASTER_SPAN_MAX_LENGTH + 1) * RASTER_SPAN_MAX_LENGTH);
+
+				const Vec3f barycentricCoordinates{
+					static_cast<float>(edges[0].Evaluate(x, y)) * setup.oneOverDoubleArea,
+					static_cast<float>(edges[1].Evaluate(x, y)) * setup.oneOverDoubleArea,
+					static_cast<float>(edges[2].Evaluate(x, y)) * setup.oneOverDoubleArea };
+
+				const IFragmentShader::FragmentSpan span{
+					.y = y - targetOrigin.y,
+					.xStart = x - targetOrigin.x,
+					.xEnd = spanEnd - targetOrigin.x,
+					.barycentricCoordinates = barycentricCoordinates,
+					.barycentricCoordinatesStep = barycentricCoordinatesStep,
+					.depth = setup.vertsZ.dot(barycentricCoordinates),
+					.depthStep = depthStep,
+					.interpolatedOneOverW = setup.vertsOneOverW.dot(barycentricCoordinates),
+					.interpolatedOneOverWStep = oneOverWStep,
+					.verticesW = setup.vertsW,
+					.depthRow = depthData + (y - targetOrigin.y) * depthWidth + (x - targetOrigin.x),
+					.depthCompare = depthTarget.GetDepthCompare() };
+				depthWritten |= fragmentShader.ShadeSpan(span, colorTarget);
+
+				x = spanEnd;
+			}
+		}
+
+		if (depthWritten)
+			UpdateFarthestDepth(depthTarget, rasterMin - targetOrigin, rasterMax - targetOrigin);
+	}
+
 	void DrawTriangleMethod3_WithZ_WithTexture(const Triangle& t, Texture& texture, const TGAColor& tint,
 		int farPlaneCoord, ZBufferBase& zBuffer, IFragmentShader& fragmentShader)
 	{
@@ -310,6 +713,11 @@ namespace sor
 		if (normal.z > 0)
 			std::swap(b, c);
 
+		// every pixel drawn is inside the bounding box of the vertices
+		zBuffer.MarkWritten(
+			{ static_cast<int>(std::floor(std::min({ a.x, b.x, c.x }))), static_cast<int>(std::floor(a.y)) },
+			{ static_cast<int>(std::ceil(std::max({ a.x, b.x, c.x }))), static_cast<int>(std::ceil(std::max(b.y, c.y))) });
+
 		// compute triangle area so we can determine the barycentric coordinates, compute uv and sample the texture
 		float triangleArea = (vertsScreenSpace[1] - vertsScreenSpace[0]).cross(vertsScreenSpace[2] - vertsScreenSpace[0]).magnitude() * 0.5f;
 
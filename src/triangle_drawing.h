@@ -6,6 +6,7 @@
 #include "geometry.h"
 #include <array>
 #include <algorithm>
+#include <cmath>
 
 namespace sor
 {
@@ -32,6 +33,132 @@ namespace sor
 		int index;
 	};
 
+	// size of the square pixel block the edge function rasterizer classifies as fully covered/empty/partially covered
+	constexpr int RASTER_BLOCK_SIZE = 8;
+	static_assert(RASTER_BLOCK_SIZE == HI_Z_TILE_SIZE, "raster blocks are tested against the hierarchical z-buffer one to one");
+
+	// size of the block the hierarchical rasterization starts from, partially covered blocks are split into quarters
+	// until they get down to RASTER_BLOCK_SIZE
+	constexpr int RASTER_COARSE_BLOCK_SIZE = 64;
+	static_assert(RASTER_COARSE_BLOCK_SIZE % RASTER_BLOCK_SIZE == 0
+		&& ((RASTER_COARSE_BLOCK_SIZE / RASTER_BLOCK_SIZE) & (RASTER_COARSE_BLOCK_SIZE / RASTER_BLOCK_SIZE - 1)) == 0,
+		"coarse block has to split into raster blocks by repeated halving");
+
+	// Spans are cut at every multiple of this in x so their stepped values are started from exact ones again. Keeps the
+	// error from adding up and makes the result independent of where the render target starts as long as it starts
+	// at a multiple of it.
+	constexpr int RASTER_SPAN_MAX_LENGTH = 64;
+
+	// with ERasterizer::AUTO triangles whose bounding box is at most this wide are rasterized in spans
+	constexpr int SPAN_RASTERIZER_MAX_WIDTH = 2 * RASTER_BLOCK_SIZE;
+
+	// triangles whose bounding box is at most this big in both directions skip the block walk, the coverage of the whole
+	// box is computed at once
+	constexpr int SMALL_TRIANGLE_MAX_SIZE = 4;
+
+	// vertices are snapped to 1/RASTER_SUBPIXEL_STEPS of a pixel (28.4 fixed point) before the triangle setup
+	constexpr int RASTER_SUBPIXEL_BITS = 4;
+	constexpr int RASTER_SUBPIXEL_STEPS = 1 << RASTER_SUBPIXEL_BITS;
+
+	// vertices further away from the screen than this (in pixels) can't be represented by the integer setup
+	constexpr float MAX_RASTER_COORDINATE = static_cast<float>(1 << 20);
+
+	// Edge function E(x, y) = a * x + b * y + c. After the triangle setup it gives the value at the center of pixel (x, y)
+	// which is non-negative exactly when the center is covered by the triangle according to the top-left fill rule.
+	// Moving one pixel in x adds a to the value, moving one pixel in y adds b.
+	struct EdgeFunction
+	{
+		i64 a;
+		i64 b;
+		i64 c;
+
+		i64 Evaluate(i64 x, i64 y) const { return a * x + b * y + c; }
+	};
+
+	// everything the rasterizer needs that only depends on the triangle, computed once per triangle
+	struct TriangleSetup
+	{
+		// edge i is the one opposite to vertex i so E_i(p) / doubleArea is the barycentric coordinate of vertex i
+		std::array<EdgeFunction, 3> edges;
+		i64 doubleArea;
+		float oneOverDoubleArea;
+
+		// bounding box clamped to the output, both inclusive
+		Vec2i bboxMin;
+		Vec2i bboxMax;
+
+		Vec3f vertsZ;			// z after perspective division for every vertex
+		float depthMargin;		// HI_Z_DEPTH_MARGIN of the largest vertex depth
+		float nearestDepth;		// no fragment of the triangle is any closer, see GetNearestDepth()
+		Vec3f vertsW;
+		Vec3f vertsOneOverW;
+	};
+
+	// Computes edge functions, bounding box and per-vertex data of the triangle.
+	// Returns false if the triangle is degenerate or doesn't cover any pixel of the output.
+	bool SetupTriangle(const Triangle& t, const Vec2i& outputSize, TriangleSetup& setup);
+
+	// Barycentric coordinates are linear in screen space so their derivatives are the same for the whole triangle, the
+	// steps of the edge functions from one pixel to the next. Every rasterizer path and the visibility buffer shading
+	// hand them to the shader the same way so they all pick the same mips.
+	inline void SetBarycentricDerivatives(const TriangleSetup& setup, IFragmentShader& fragmentShader)
+	{
+		const std::array<EdgeFunction, 3>& edges = setup.edges;
+		fragmentShader.SetBarycentricDerivatives(
+			Vec3f{ static_cast<float>(edges[0].a), static_cast<float>(edges[1].a), static_cast<float>(edges[2].a) } * setup.oneOverDoubleArea,
+			Vec3f{ static_cast<float>(edges[0].b), static_cast<float>(edges[1].b), static_cast<float>(edges[2].b) } * setup.oneOverDoubleArea);
+	}
+
+	// Steps of the triangle setup, shared by SetupTriangle and TriangleSetupBatch so both give exactly the same result.
+
+	// pixel coordinate snapped to the subpixel grid
+	inline i64 SnapToSubpixel(float coordinate) { return static_cast<i64>(std::round(coordinate * RASTER_SUBPIXEL_STEPS)); }
+
+	// first and last pixel whose center is inside of the range given in subpixels
+	inline i64 GetFirstPixelInside(i64 subpixelMin)
+	{
+		return (subpixelMin - RASTER_SUBPIXEL_STEPS / 2 + RASTER_SUBPIXEL_STEPS - 1) >> RASTER_SUBPIXEL_BITS;
+	}
+	inline i64 GetLastPixelInside(i64 subpixelMax) { return (subpixelMax - RASTER_SUBPIXEL_STEPS / 2) >> RASTER_SUBPIXEL_BITS; }
+
+	// Edge function of the edge going from vertex j to vertex k (in subpixels), evaluated at the third vertex it gives
+	// the doubled signed area of the triangle so flipping it for CW triangles (orientation -1) makes the inside positive
+	// for both windings.
+	inline EdgeFunction SetupEdgeFunction(const Vec2<i64>& vj, const Vec2<i64>& vk, i64 orientation)
+	{
+		// in subpixel coordinates
+		const i64 a = (vj.y - vk.y) * orientation;
+		const i64 b = (vk.x - vj.x) * orientation;
+		const i64 c = -(a * vj.x + b * vj.y);
+
+		// Top-left fill rule: a pixel center lying exactly on an edge belongs to the triangle only if the edge is a left
+		// one (the inside is in +x direction) or a top one (horizontal with the inside below, y goes up the screen).
+		// The triangle on the other side of a shared edge sees it the other way around so every such pixel is
+		// rasterized exactly once. Other edges are pulled in by the smallest step so their zero isn't inside.
+		const bool isTopLeft = a > 0 || (a == 0 && b < 0);
+
+		// rescaled so that the function is evaluated at pixel centers and stepped by whole pixels
+		return {
+			a * RASTER_SUBPIXEL_STEPS,
+			b * RASTER_SUBPIXEL_STEPS,
+			c + (a + b) * (RASTER_SUBPIXEL_STEPS / 2) - (isTopLeft ? 0 : 1) };
+	}
+
+	// HI_Z_DEPTH_MARGIN of the largest vertex depth
+	inline float GetDepthMargin(const Vec3f& vertsZ)
+	{
+		return HI_Z_DEPTH_MARGIN * std::max({ std::abs(vertsZ.x), std::abs(vertsZ.y), std::abs(vertsZ.z) });
+	}
+
+	// Closest depth a fragment of the triangle can have. The fill rule takes up to one from every edge function so the
+	// barycentric coordinates of the fragments can sum up to a bit less than one, noticeably for slivers with a tiny
+	// area, which scales the interpolated depth down.
+	inline float GetNearestDepth(const Vec3f& vertsZ, i64 doubleArea, float depthMargin)
+	{
+		const float nearestVertexDepth = std::min({ vertsZ.x, vertsZ.y, vertsZ.z });
+		const float smallestBarycentricSum = std::max(1.f - 3.f / static_cast<float>(doubleArea), 0.f);
+		return std::min(nearestVertexDepth, nearestVertexDepth * smallestBarycentricSum) - depthMargin;
+	}
 
 	// draws just lines between triangle vertices
 	void DrawTriangleWired(const Triangle& t, Texture& output, const TGAColor& color);
@@ -39,6 +166,34 @@ namespace sor
 	// draw using standard method of computing bounding box and then barycentric coordinates for every pixel to find out if it's inside of the triangle
 	void DrawTriangle_Standard(const Triangle& t, Texture& outputTex, ZBufferBase& zBuffer, IFragmentShader& fragmentShader);
 
+	// same bounding box approach as DrawTriangle_Standard but the barycentric coordinates come from edge functions that are
+	// set up once per triangle and then stepped with integer adds. The bounding box is walked hierarchically, starting with
+	// RASTER_COARSE_BLOCK_SIZE blocks, fully covered blocks skip the inside test, empty blocks are skipped altogether and
+	// partially covered ones are split until they reach RASTER_BLOCK_SIZE, so the cost follows the covered area.
+	void DrawTriangle_EdgeFunction(const Triangle& t, Texture& outputTex, ZBufferBase& zBuffer, IFragmentShader& fragmentShader);
+
+	// Rasterizes already set up triangle into color and depth buffers that cover only part of the screen, starting at
+	// targetOrigin and having the size of the color buffer. Pixels outside of that area are skipped.
+	// RASTERIZER decides whether it's walked in blocks or in spans unless the fragment shader only works with spans.
+	void RasterizeTriangle(const TriangleSetup& setup, Texture& colorTarget, ZBufferBase& depthTarget, const Vec2i& targetOrigin,
+		IFragmentShader& fragmentShader);
+
+	// How RasterizeTriangle() walks the triangle for a shader with the flags, that also decides how the depth of its
+	// fragments is interpolated.
+	enum class ERasterPath : u8
+	{
+		SMALL_TRIANGLE,	// pixel by pixel, the depth is computed from the edge values of every pixel
+		SPANS,			// the depth is stepped from pixel to pixel along every span
+		BLOCKS			// the same depth as the small triangles, whichever kernel rasterizes the block
+	};
+	ERasterPath GetRasterPath(const TriangleSetup& setup, EFragmentShaderFlags shaderFlags, ZBufferBase& depthTarget);
+
+	// Same as RasterizeTriangle but the covered part of every row is found directly from the edge functions and handed
+	// to the fragment shader as a span. Doesn't waste any work on the empty part of the bounding box so it's cheaper
+	// for thin triangles. Needs a float depth buffer.
+	void RasterizeTriangle_Spans(const TriangleSetup& setup, Texture& colorTarget, ZBufferBase& depthTarget, const Vec2i& targetOrigin,
+		IFragmentShader& fragmentShader);
+
 	/// <summary>
 	///	Draws the triangle given by 3 coordinates that have Z coordinate as int
 	/// </summary>
@@ -4,15 +4,19 @@
 #include "triangle_drawing.h"
 #include "geometry.h"
 #include "random.h"
+#include "clipping.h"
 #include "constants.h"
 #include "input.h"
 #include "math.h"
+#include "mesh_clusters.h"
 #include "my_gl.h"
+#include "pipeline.h"
 #include "shader.h"
 #include "TGAColor.h"
 #include "tgaimage.h"
 #include "transformations.h"
 #include "time.h"
+#include "vertex_processing.h"
 
 namespace sor
 {
@@ -96,6 +100,13 @@ namespace sor
 		Model model;
 		Texture screenTexture;
 		std::unique_ptr<ZBufferBase> zBuffer = std::make_unique<ZBufferFloatDefault>();
+		TiledRenderer tiledRenderer;
+		VisibilityBufferRenderer visibilityBufferRenderer;
+		SortLastRenderer sortLastRenderer;
+		WireframeRenderer wireframeRenderer;
+		TransformedVertexBuffer transformedVertices;
+		MeshClusters meshClusters;
+		FaceCuller faceCuller;
 
 		// textures
 		TGAImage albedoTexture;
@@ -113,11 +124,13 @@ namespace sor
 
 		g_DrawContext.albedoTexture.read_tga_file(ALBEDO_PATHS[(int) SCENE]);
 		g_DrawContext.albedoTexture.flip_vertically();
+		g_DrawContext.albedoTexture.GenerateMips();
 
 		if (NORMAL_TEXTURE_PATHS[(int) SCENE] != nullptr)
 		{
 			g_DrawContext.normalTexture.read_tga_file(NORMAL_TEXTURE_PATHS[(int) SCENE]);
 			g_DrawContext.normalTexture.flip_vertically();
+			g_DrawContext.normalTexture.GenerateMips();
 			fragmentShader.SetNormalTexture(&g_DrawContext.normalTexture);
 		}
 
@@ -125,6 +138,7 @@ namespace sor
 		{
 			g_DrawContext.specularTexture.read_tga_file(SPECULAR_TEXTURE_PATHS[(int) SCENE]);
 			g_DrawContext.specularTexture.flip_vertically();
+			g_DrawContext.specularTexture.GenerateMips();
 			fragmentShader.SetSpecularTexture(&g_DrawContext.specularTexture);
 		}
 		
@@ -145,6 +159,10 @@ namespace sor
 
 		vertexShader.SetModel(&g_DrawContext.model);
 		fragmentShader.SetAlbedoTexture(&g_DrawContext.albedoTexture);
+
+		g_DrawContext.meshClusters.Build(g_DrawContext.model);
+		if constexpr (RENDER_MODE == ERenderMode::WIREFRAME)
+			g_DrawContext.wireframeRenderer.Build(g_DrawContext.model);
 	}
 
 	//--------------------------------------------------------------------------------------------------
@@ -168,46 +186,155 @@ namespace sor
 	}
 
 	//--------------------------------------------------------------------------------------------------
-	void inline DrawModel(DrawContext* pDrawContext)
+	// rasterizes the triangle right away or hands it to the deferred renderer, varying data is taken from the vertex shader
+	void inline DrawTriangle(DrawContext* pDrawContext, const Triangle& t)
 	{
-		// the output image in case I ever need it again
-		//TGAImage image(IMAGE_SIZE_DEFAULT_X, IMAGE_SIZE_DEFAULT_Y, TGAImage::RGB);
-		// for each face get all the triangle data and render
-		const int numFaces = pDrawContext->model.nfaces();
-		for (int i = 0; i < numFaces; i++)
+		if constexpr (RENDER_MODE == ERenderMode::TILED)
 		{
-			std::vector<int> face = pDrawContext->model.face(i);
-			Vec3f v0 = pDrawContext->model.vert(face[0]);
-			Vec3f v1 = pDrawContext->model.vert(face[2]);
-			Vec3f v2 = pDrawContext->model.vert(face[4]);
+			pDrawContext->tiledRenderer.SubmitTriangle(t, vertexShader);
+			return;
+		}
 
-			Vec3f triangleNormal = (v1 - v0).cross(v2 - v0).normalize();
-			const Vec3f triangleNormalWS = (ModelMat * triangleNormal.ToDirection()).ToVec3().normalize();
+		if constexpr (RENDER_MODE == ERenderMode::VISIBILITY_BUFFER)
+		{
+			pDrawContext->visibilityBufferRenderer.SubmitTriangle(t, vertexShader);
+			return;
+		}
 
-			float shading = triangleNormalWS.dot((CAMERA_POSITION - v0).normalize());
+		if constexpr (RENDER_MODE == ERenderMode::SORT_LAST)
+		{
+			pDrawContext->sortLastRenderer.SubmitTriangle(t, vertexShader);
+			return;
+		}
 
-			if (shading < 0.0f) // backface culling
-				continue;
+		// DrawTriangleWired(t, g_DrawContext.screenTexture, TGAColor::FromFloat( 1.0f, 1.0f, 1.0f, 0.f ));
+		// DrawTriangle_Standard(t, g_DrawContext.screenTexture, *g_DrawContext.zBuffer, fragmentShader);
+		DrawTriangle_EdgeFunction(t, pDrawContext->screenTexture, *pDrawContext->zBuffer, fragmentShader);
+		// DrawTriangleMethod3_WithZ_WithTexture(t, g_DrawContext.screenTexture, tint, FAR_PLANE, *g_DrawContext.zBuffer, fragmentShader);
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	// Culls whole clusters of faces first, runs the vertex shader for every unique vertex of the model, then culls and
+	// clips the faces of the clusters that are left and calls drawTriangle for what's left of them. Without varying data
+	// only the positions of the vertices are computed and the vertex shader doesn't write any varyings. Clusters are
+	// tested against the hierarchical z-buffer of occluders too if it's given.
+	template<typename TDrawTriangleFunc>
+	void inline ForEachModelTriangle(DrawContext* pDrawContext, bool withVaryingData, const ZBufferBase* occluders,
+		const TDrawTriangleFunc& drawTriangle)
+	{
+		const Vec2i screenSize{ pDrawContext->screenTexture.GetWidth(), pDrawContext->screenTexture.GetHeight() };
+		const Model& model = pDrawContext->model;
+		TransformedVertexBuffer& vertices = pDrawContext->transformedVertices;
+		ClippedPolygon clippedPolygon;
 
-			TGAColor tint = TGAColor::FromFloat(1.0f, 1.0f, 1.0f, 1.0f);
+		pDrawContext->meshClusters.Cull(ViewportMat * ProjectionMat * ViewMat * ModelMat, screenSize, occluders);
+		vertices.Transform(model, vertexShader, ViewportMat, withVaryingData);
+		pDrawContext->faceCuller.Cull(model, vertices, pDrawContext->meshClusters.GetVisibleFaces(), screenSize);
 
-			Vec4f screenSpacePosV0 = ViewportMat * vertexShader.vertex(i, 0);
-			Vec4f screenSpacePosV1 = ViewportMat * vertexShader.vertex(i, 1);
-			Vec4f screenSpacePosV2 = ViewportMat * vertexShader.vertex(i, 2);
+		// for each face that survived culling fetch all the triangle data by the indices of its vertices and render
+		for (const u32 faceIdx : pDrawContext->faceCuller.GetVisibleFaces())
+		{
+			const int i = static_cast<int>(faceIdx);
+			const std::array<u32, 3> indices{ model.GetUniqueVertexIndex(i, 0), model.GetUniqueVertexIndex(i, 1),
+				model.GetUniqueVertexIndex(i, 2) };
 
 			Triangle t
 			{
-				screenSpacePosV0, screenSpacePosV1, screenSpacePosV2,
+				vertices.GetPosition(indices[0]), vertices.GetPosition(indices[1]), vertices.GetPosition(indices[2]),
 				i
 			};
 
-			g_DrawContext.zBuffer->Clear();
-			// DrawTriangleWired(t, g_DrawContext.screenTexture, TGAColor::FromFloat( 1.0f, 1.0f, 1.0f, 0.f ));
-			DrawTriangle_Standard(t, g_DrawContext.screenTexture, *g_DrawContext.zBuffer, fragmentShader);
-			// DrawTriangleMethod3_WithZ_WithTexture(t, g_DrawContext.screenTexture, tint, FAR_PLANE, *g_DrawContext.zBuffer, fragmentShader);
+			const EClipResult clipResult = ClipTriangle(t, screenSize, clippedPolygon);
+			if (clipResult == EClipResult::CULLED)
+				continue;
 
-			//printf("Drawn face %d out of %d, progress: %.2f %% \n", i, numFaces, (static_cast<float>(i) / numFaces) * 100);
+			if (withVaryingData)
+			{
+				vertexShader.SetTriangleVaryingData({ vertices.GetVaryingData(indices[0]), vertices.GetVaryingData(indices[1]),
+					vertices.GetVaryingData(indices[2]) });
+			}
+
+			if (clipResult == EClipResult::UNCLIPPED)
+			{
+				drawTriangle(t);
+				continue;
+			}
+
+			// every triangle of the clipped polygon gets its own varying data, blended from the data of the whole triangle
+			const IShaderBase::TriangleVaryingData originalVaryingData = vertexShader.GetTriangleVaryingData();
+			for (int clippedIdx = 0; clippedIdx < clippedPolygon.GetTriangleCount(); clippedIdx++)
+			{
+				if (withVaryingData)
+					vertexShader.SetTriangleVaryingData(clippedPolygon.GetVaryingData(clippedIdx, originalVaryingData));
+				drawTriangle(clippedPolygon.GetTriangle(clippedIdx, i));
+			}
 		}
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	// rasterizes only the depth of the front facing triangles of the model into the z-buffer
+	void inline DrawDepthPrepass(DrawContext* pDrawContext)
+	{
+		DepthOnlyShader depthOnlyShader(fragmentShader.GetFlags());
+		ForEachModelTriangle(pDrawContext, false, nullptr, [pDrawContext, &depthOnlyShader](const Triangle& t)
+		{
+			DrawTriangle_EdgeFunction(t, pDrawContext->screenTexture, *pDrawContext->zBuffer, depthOnlyShader);
+		});
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void inline DrawModel(DrawContext* pDrawContext)
+	{
+		// the output image in case I ever need it again
+		//TGAImage image(IMAGE_SIZE_DEFAULT_X, IMAGE_SIZE_DEFAULT_Y, TGAImage::RGB);
+		const Vec2i screenSize{ pDrawContext->screenTexture.GetWidth(), pDrawContext->screenTexture.GetHeight() };
+
+		pDrawContext->zBuffer->Clear();
+		if constexpr (RENDER_MODE == ERenderMode::TILED)
+			pDrawContext->tiledRenderer.BeginFrame(screenSize);
+		else if constexpr (RENDER_MODE == ERenderMode::VISIBILITY_BUFFER)
+			pDrawContext->visibilityBufferRenderer.BeginFrame(screenSize);
+		else if constexpr (RENDER_MODE == ERenderMode::SORT_LAST)
+			pDrawContext->sortLastRenderer.BeginFrame(screenSize);
+
+		if constexpr (RENDER_MODE == ERenderMode::WIREFRAME)
+		{
+			if constexpr (WIREFRAME_HIDDEN_LINES)
+				DrawDepthPrepass(pDrawContext);
+
+			pDrawContext->wireframeRenderer.Draw(pDrawContext->model, ViewportMat * ProjectionMat * ViewMat * ModelMat,
+				pDrawContext->screenTexture, TGAColor::FromFloat(1.f, 1.f, 1.f, 1.f),
+				WIREFRAME_HIDDEN_LINES ? pDrawContext->zBuffer.get() : nullptr, WIREFRAME_DEPTH_BIAS);
+			return;
+		}
+
+		if constexpr (RENDER_MODE == ERenderMode::DEPTH_PREPASS)
+		{
+			// the shading pass has to test the depth before fragment() for the prepass depth to be final
+			assert(fragmentShader.GetDepthTestStage() == EDepthTestStage::EARLY);
+
+			DrawDepthPrepass(pDrawContext);
+
+			// every pixel is shaded only by the triangle that's visible in it, unless several of them have exactly
+			// the same depth there
+			pDrawContext->zBuffer->SetDepthCompare(EDepthCompare::EQUAL);
+		}
+
+		// after a depth prepass the z-buffer already holds the final depth, so it can hide whole clusters
+		const ZBufferBase* occluders = RENDER_MODE == ERenderMode::DEPTH_PREPASS ? pDrawContext->zBuffer.get() : nullptr;
+		ForEachModelTriangle(pDrawContext, true, occluders, [pDrawContext](const Triangle& t)
+		{
+			DrawTriangle(pDrawContext, t);
+		});
+
+		pDrawContext->zBuffer->SetDepthCompare(EDepthCompare::LESS);
+
+		if constexpr (RENDER_MODE == ERenderMode::TILED)
+			pDrawContext->tiledRenderer.EndFrame(pDrawContext->screenTexture, fragmentShader);
+		else if constexpr (RENDER_MODE == ERenderMode::VISIBILITY_BUFFER)
+			pDrawContext->visibilityBufferRenderer.EndFrame(pDrawContext->screenTexture, fragmentShader);
+		else if constexpr (RENDER_MODE == ERenderMode::SORT_LAST)
+			pDrawContext->sortLastRenderer.EndFrame(pDrawContext->screenTexture, fragmentShader);
 
 
 		// image.flip_vertically();
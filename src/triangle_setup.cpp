@@ -0,0 +1,183 @@
+#include "triangle_setup.h"
+
+#include "Instrumentor.h"
+#include "thread_pool.h"
+
+namespace sor
+{
+	//--------------------------------------------------------------------------------------------------
+	void TriangleSetupBatch::Setup(std::span<const Triangle> triangles, const Vec2i& outputSize, bool sortFrontToBack)
+	{
+		const size_t count = triangles.size();
+
+		// keep the allocations from the previous frame around
+		for (int i = 0; i < 3; i++)
+		{
+			m_X[i].resize(count);
+			m_Y[i].resize(count);
+			m_Z[i].resize(count);
+			m_W[i].resize(count);
+			m_OneOverW[i].resize(count);
+			m_SubpixelX[i].resize(count);
+			m_SubpixelY[i].resize(count);
+			m_EdgeA[i].resize(count);
+			m_EdgeB[i].resize(count);
+			m_EdgeC[i].resize(count);
+		}
+		m_BboxMinX.resize(count);
+		m_BboxMinY.resize(count);
+		m_BboxMaxX.resize(count);
+		m_BboxMaxY.resize(count);
+		m_DoubleArea.resize(count);
+		m_OneOverDoubleArea.resize(count);
+		m_DepthMargin.resize(count);
+		m_NearestDepth.resize(count);
+		m_Survives.resize(count);
+		m_SortKeys.resize(sortFrontToBack ? count : 0);
+		m_Setups.resize(count);
+
+		const int batchCount = static_cast<int>((count + TRIANGLE_SETUP_BATCH_SIZE - 1) / TRIANGLE_SETUP_BATCH_SIZE);
+		GetThreadPool().ParallelFor(batchCount, [this, triangles, &outputSize, sortFrontToBack](int batchIdx, int)
+		{
+			const int begin = batchIdx * TRIANGLE_SETUP_BATCH_SIZE;
+			SetupRange(triangles, begin, std::min(begin + TRIANGLE_SETUP_BATCH_SIZE, static_cast<int>(triangles.size())), outputSize,
+				sortFrontToBack);
+		});
+
+		m_SurvivingTriangles.clear();
+		m_SurvivingSortKeys.clear();
+		for (u32 triangleIdx = 0; triangleIdx < count; triangleIdx++)
+		{
+			if (!m_Survives[triangleIdx])
+				continue;
+
+			m_SurvivingTriangles.push_back(triangleIdx);
+			if (sortFrontToBack)
+				m_SurvivingSortKeys.push_back(m_SortKeys[triangleIdx]);
+		}
+
+		if (sortFrontToBack)
+		{
+			PROFILE_SCOPE("TriangleSetupBatch::SortFrontToBack")
+			m_Sorter.Sort(m_SurvivingSortKeys, m_SurvivingTriangles);
+		}
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void TriangleSetupBatch::SetupRange(std::span<const Triangle> triangles, int begin, int end, const Vec2i& outputSize,
+		bool sortFrontToBack)
+	{
+		// transposed into the arrays first, the rest of the steps only read the arrays
+		for (int t = begin; t < end; t++)
+		{
+			const std::array<const Vec4f*, 3> vertices{ &triangles[t].v0ss, &triangles[t].v1ss, &triangles[t].v2ss };
+			for (int i = 0; i < 3; i++)
+			{
+				m_X[i][t] = vertices[i]->x();
+				m_Y[i][t] = vertices[i]->y();
+				m_Z[i][t] = vertices[i]->z();
+				m_W[i][t] = vertices[i]->w();
+			}
+			m_Survives[t] = 1;
+		}
+
+		// perspective division and snapping, same as Vector4::FromHomogeneous, w itself is kept as it is
+		for (int i = 0; i < 3; i++)
+		{
+			for (int t = begin; t < end; t++)
+			{
+				const float w = m_W[i][t] != 0.f ? m_W[i][t] : 1.f;
+				const float x = m_X[i][t] / w;
+				const float y = m_Y[i][t] / w;
+				m_Z[i][t] = m_Z[i][t] / w;
+
+				// the integer setup can't represent vertices too far off the screen, the snapped value of those isn't used
+				const bool fitsRaster = std::abs(x) < MAX_RASTER_COORDINATE && std::abs(y) < MAX_RASTER_COORDINATE;
+				m_Survives[t] &= fitsRaster ? 1 : 0;
+				m_SubpixelX[i][t] = fitsRaster ? SnapToSubpixel(x) : 0;
+				m_SubpixelY[i][t] = fitsRaster ? SnapToSubpixel(y) : 0;
+			}
+		}
+
+		// bounding boxes
+		for (int t = begin; t < end; t++)
+		{
+			const i64 minX = std::min({ m_SubpixelX[0][t], m_SubpixelX[1][t], m_SubpixelX[2][t] });
+			const i64 minY = std::min({ m_SubpixelY[0][t], m_SubpixelY[1][t], m_SubpixelY[2][t] });
+			const i64 maxX = std::max({ m_SubpixelX[0][t], m_SubpixelX[1][t], m_SubpixelX[2][t] });
+			const i64 maxY = std::max({ m_SubpixelY[0][t], m_SubpixelY[1][t], m_SubpixelY[2][t] });
+
+			m_BboxMinX[t] = static_cast<i32>(std::max<i64>(GetFirstPixelInside(minX), 0));
+			m_BboxMinY[t] = static_cast<i32>(std::max<i64>(GetFirstPixelInside(minY), 0));
+			m_BboxMaxX[t] = static_cast<i32>(std::min<i64>(GetLastPixelInside(maxX), outputSize.x - 1));
+			m_BboxMaxY[t] = static_cast<i32>(std::min<i64>(GetLastPixelInside(maxY), outputSize.y - 1));
+
+			m_Survives[t] &= (m_BboxMinX[t] <= m_BboxMaxX[t] && m_BboxMinY[t] <= m_BboxMaxY[t]) ? 1 : 0;
+		}
+
+		// doubled signed areas
+		for (int t = begin; t < end; t++)
+		{
+			m_DoubleArea[t] = (m_SubpixelX[1][t] - m_SubpixelX[0][t]) * (m_SubpixelY[2][t] - m_SubpixelY[0][t])
+				- (m_SubpixelY[1][t] - m_SubpixelY[0][t]) * (m_SubpixelX[2][t] - m_SubpixelX[0][t]);
+			m_Survives[t] &= m_DoubleArea[t] != 0 ? 1 : 0;
+		}
+
+		// edge functions, edge i goes from vertex j to vertex k
+		for (int i = 0; i < 3; i++)
+		{
+			const int j = (i + 1) % 3;
+			const int k = (i + 2) % 3;
+			for (int t = begin; t < end; t++)
+			{
+				const EdgeFunction edge = SetupEdgeFunction({ m_SubpixelX[j][t], m_SubpixelY[j][t] }, { m_SubpixelX[k][t], m_SubpixelY[k][t] },
+					m_DoubleArea[t] > 0 ? 1 : -1);
+				m_EdgeA[i][t] = edge.a;
+				m_EdgeB[i][t] = edge.b;
+				m_EdgeC[i][t] = edge.c;
+			}
+		}
+
+		// values the interpolation and the depth tests need
+		for (int t = begin; t < end; t++)
+		{
+			m_DoubleArea[t] = std::abs(m_DoubleArea[t]);
+			m_OneOverDoubleArea[t] = 1.f / static_cast<float>(m_DoubleArea[t]);
+			m_DepthMargin[t] = GetDepthMargin(Vec3f{ m_Z[0][t], m_Z[1][t], m_Z[2][t] });
+			m_NearestDepth[t] = GetNearestDepth(Vec3f{ m_Z[0][t], m_Z[1][t], m_Z[2][t] }, m_DoubleArea[t], m_DepthMargin[t]);
+		}
+		for (int i = 0; i < 3; i++)
+		{
+			for (int t = begin; t < end; t++)
+				m_OneOverW[i][t] = 1.f / m_W[i][t];
+		}
+
+		// w is the view space depth
+		if (sortFrontToBack)
+		{
+			for (int t = begin; t < end; t++)
+				m_SortKeys[t] = FloatToSortKey(std::min({ m_W[0][t], m_W[1][t], m_W[2][t] }));
+		}
+
+		// records of the surviving triangles
+		for (int t = begin; t < end; t++)
+		{
+			if (!m_Survives[t])
+				continue;
+
+			TriangleSetup& setup = m_Setups[t];
+			for (int i = 0; i < 3; i++)
+				setup.edges[i] = { m_EdgeA[i][t], m_EdgeB[i][t], m_EdgeC[i][t] };
+
+			setup.doubleArea = m_DoubleArea[t];
+			setup.oneOverDoubleArea = m_OneOverDoubleArea[t];
+			setup.bboxMin = { m_BboxMinX[t], m_BboxMinY[t] };
+			setup.bboxMax = { m_BboxMaxX[t], m_BboxMaxY[t] };
+			setup.vertsZ = Vec3f{ m_Z[0][t], m_Z[1][t], m_Z[2][t] };
+			setup.depthMargin = m_DepthMargin[t];
+			setup.nearestDepth = m_NearestDepth[t];
+			setup.vertsW = Vec3f{ m_W[0][t], m_W[1][t], m_W[2][t] };
+			setup.vertsOneOverW = Vec3f{ m_OneOverW[0][t], m_OneOverW[1][t], m_OneOverW[2][t] };
+		}
+	}
+}
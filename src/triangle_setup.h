@@ -0,0 +1,71 @@
+#pragma once
+
+#include <span>
+#include <vector>
+
+#include "radix_sort.h"
+#include "triangle_drawing.h"
+
+namespace sor
+{
+	// how many triangles one worker sets up at a time
+	constexpr int TRIANGLE_SETUP_BATCH_SIZE = 1024;
+
+	//--------------------------------------------------------------------------------------------------
+	// Front end of the deferred renderers, sets up all triangles of a frame before any of them is rasterized. The
+	// triangles are split into batches that are set up in parallel. Within a batch every step of the setup is a simple
+	// loop over structure of arrays (one array per value and vertex) so the compiler can vectorise it across triangles.
+	// The result is a TriangleSetup record for every triangle that survived, in the submission order or sorted front to
+	// back, the back end only reads those. Gives exactly the same result as SetupTriangle.
+	class TriangleSetupBatch
+	{
+	public:
+		// Drops the triangles that are degenerate or don't cover any pixel of the output. Sorting front to back orders
+		// the rest by the view space depth of their nearest vertex, the triangles with the same depth keep their order.
+		void Setup(std::span<const Triangle> triangles, const Vec2i& outputSize, bool sortFrontToBack);
+
+		// triangles that survived the setup
+		int GetCount() const { return static_cast<int>(m_SurvivingTriangles.size()); }
+		const TriangleSetup& GetSetup(int idx) const { return m_Setups[m_SurvivingTriangles[idx]]; }
+		// index of the triangle in the span given to Setup()
+		u32 GetTriangleIdx(int idx) const { return m_SurvivingTriangles[idx]; }
+
+	private:
+		template<typename T>
+		using VertexArrays = std::array<std::vector<T>, 3>;
+
+		// sets up triangles [begin, end)
+		void SetupRange(std::span<const Triangle> triangles, int begin, int end, const Vec2i& outputSize, bool sortFrontToBack);
+
+		// per vertex, after the perspective division
+		VertexArrays<float> m_X;
+		VertexArrays<float> m_Y;
+		VertexArrays<float> m_Z;
+		VertexArrays<float> m_W;
+		VertexArrays<float> m_OneOverW;
+		VertexArrays<i64> m_SubpixelX;
+		VertexArrays<i64> m_SubpixelY;
+
+		// per triangle
+		std::vector<i32> m_BboxMinX;
+		std::vector<i32> m_BboxMinY;
+		std::vector<i32> m_BboxMaxX;
+		std::vector<i32> m_BboxMaxY;
+		std::vector<i64> m_DoubleArea;
+		std::vector<float> m_OneOverDoubleArea;
+		std::vector<float> m_DepthMargin;
+		std::vector<float> m_NearestDepth;
+		std::vector<u8> m_Survives;
+		std::vector<u32> m_SortKeys;
+
+		// per edge, edge i is the one opposite to vertex i
+		VertexArrays<i64> m_EdgeA;
+		VertexArrays<i64> m_EdgeB;
+		VertexArrays<i64> m_EdgeC;
+
+		std::vector<TriangleSetup> m_Setups;		// for every triangle, only valid for the ones that survived
+		std::vector<u32> m_SurvivingTriangles;
+		std::vector<u32> m_SurvivingSortKeys;
+		RadixSorter m_Sorter;
+	};
+}
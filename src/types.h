@@ -7,6 +7,7 @@ namespace sor
 	using u16 = uint16_t;
 	using u8 = uint8_t;
 
+	using i64 = int64_t;
 	using i32 = int32_t;
 	using i16 = int16_t;
 	using i8 = int8_t;
@@ -0,0 +1,237 @@
+#include "vertex_processing.h"
+
+#include <algorithm>
+
+#include "constants.h"
+#include "cpu_features.h"
+#include "Instrumentor.h"
+#include "thread_pool.h"
+
+namespace sor
+{
+	namespace
+	{
+		// Same order of operations as Vector4::dot of a matrix row and the vector. The wide versions transform as many
+		// whole groups of vectors as there are and return how many that was, the rest is left to the scalar one.
+		void TransformStreams_Scalar(const Mat4& mat, const std::array<const float*, 4>& input,
+			const std::array<float*, 4>& output, int first, int count)
+		{
+			for (int i = first; i < count; i++)
+			{
+				const float x = input[0][i];
+				const float y = input[1][i];
+				const float z = input[2][i];
+				const float w = input[3][i];
+				for (int row = 0; row < 4; row++)
+				{
+					output[row][i] = mat.GetElement(row, 0) * x + mat.GetElement(row, 1) * y + mat.GetElement(row, 2) * z
+						+ mat.GetElement(row, 3) * w;
+				}
+			}
+		}
+
+		SOR_TARGET_SSE2 int TransformStreams_SSE2(const Mat4& mat, const std::array<const float*, 4>& input,
+			const std::array<float*, 4>& output, int count)
+		{
+#if SOR_SIMD_X86
+			__m128 elements[4][4];
+			for (int row = 0; row < 4; row++)
+			{
+				for (int column = 0; column < 4; column++)
+					elements[row][column] = _mm_set1_ps(mat.GetElement(row, column));
+			}
+
+			int i = 0;
+			for (; i + 4 <= count; i += 4)
+			{
+				const __m128 x = _mm_loadu_ps(input[0] + i);
+				const __m128 y = _mm_loadu_ps(input[1] + i);
+				const __m128 z = _mm_loadu_ps(input[2] + i);
+				const __m128 w = _mm_loadu_ps(input[3] + i);
+				for (int row = 0; row < 4; row++)
+				{
+					_mm_storeu_ps(output[row] + i, _mm_add_ps(_mm_add_ps(_mm_add_ps(
+						_mm_mul_ps(elements[row][0], x),
+						_mm_mul_ps(elements[row][1], y)),
+						_mm_mul_ps(elements[row][2], z)),
+						_mm_mul_ps(elements[row][3], w)));
+				}
+			}
+
+			return i;
+#else
+			return 0;
+#endif
+		}
+
+		SOR_TARGET_AVX2 int TransformStreams_AVX2(const Mat4& mat, const std::array<const float*, 4>& input,
+			const std::array<float*, 4>& output, int count)
+		{
+#if SOR_SIMD_X86
+			__m256 elements[4][4];
+			for (int row = 0; row < 4; row++)
+			{
+				for (int column = 0; column < 4; column++)
+					elements[row][column] = _mm256_set1_ps(mat.GetElement(row, column));
+			}
+
+			// no FMA, it would round differently than the scalar code
+			int i = 0;
+			for (; i + 8 <= count; i += 8)
+			{
+				const __m256 x = _mm256_loadu_ps(input[0] + i);
+				const __m256 y = _mm256_loadu_ps(input[1] + i);
+				const __m256 z = _mm256_loadu_ps(input[2] + i);
+				const __m256 w = _mm256_loadu_ps(input[3] + i);
+				for (int row = 0; row < 4; row++)
+				{
+					_mm256_storeu_ps(output[row] + i, _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+						_mm256_mul_ps(elements[row][0], x),
+						_mm256_mul_ps(elements[row][1], y)),
+						_mm256_mul_ps(elements[row][2], z)),
+						_mm256_mul_ps(elements[row][3], w)));
+				}
+			}
+
+			return i;
+#else
+			return 0;
+#endif
+		}
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void TransformStreams(const Mat4& mat, const std::array<const float*, 4>& input, const std::array<float*, 4>& output,
+		int count)
+	{
+		int transformedCount = 0;
+#if SOR_SIMD_X86
+		switch (std::min(GetSimdLevel(), MAX_VERTEX_SIMD_LEVEL))
+		{
+		case ESimdLevel::AVX2:
+			transformedCount = TransformStreams_AVX2(mat, input, output, count);
+			break;
+		case ESimdLevel::SSE2:
+			transformedCount = TransformStreams_SSE2(mat, input, output, count);
+			break;
+		default:
+			break;
+		}
+#endif
+		TransformStreams_Scalar(mat, input, output, transformedCount, count);
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void TransformedVertexBuffer::Transform(const Model& model, const IVertexShader& vertexShader, const Mat4& viewport,
+		bool withVaryingData)
+	{
+		PROFILE_SCOPE("TransformedVertexBuffer::Transform")
+
+		const int vertexCount = model.GetUniqueVertexCount();
+		m_Positions.resize(vertexCount);
+		if (withVaryingData)
+			m_VaryingData.resize(vertexCount);
+
+		// every batch only writes its own part of the buffer
+		const int batchCount = (vertexCount + VERTEX_BATCH_SIZE - 1) / VERTEX_BATCH_SIZE;
+		GetThreadPool().ParallelFor(batchCount, [this, &vertexShader, &viewport, withVaryingData, vertexCount](int batchIdx, int)
+		{
+			const int first = batchIdx * VERTEX_BATCH_SIZE;
+			const int count = std::min(VERTEX_BATCH_SIZE, vertexCount - first);
+
+			alignas(32) float positionsCS[4][VERTEX_BATCH_SIZE];
+			alignas(32) float positionsSS[4][VERTEX_BATCH_SIZE];
+			const std::array<float*, 4> positionsCSStreams{ positionsCS[0], positionsCS[1], positionsCS[2], positionsCS[3] };
+
+			if (withVaryingData)
+				vertexShader.VertexBatch(first, count, positionsCSStreams, &m_VaryingData[first]);
+			else
+				vertexShader.PositionBatch(first, count, positionsCSStreams);
+
+			TransformStreams(viewport, { positionsCS[0], positionsCS[1], positionsCS[2], positionsCS[3] },
+				{ positionsSS[0], positionsSS[1], positionsSS[2], positionsSS[3] }, count);
+
+			for (int i = 0; i < count; i++)
+				m_Positions[first + i] = Vec4f{ positionsSS[0][i], positionsSS[1][i], positionsSS[2][i], positionsSS[3][i] };
+		});
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void FaceCuller::Cull(const Model& model, const TransformedVertexBuffer& vertices, std::span<const u32> candidateFaces,
+		const Vec2i& outputSize)
+	{
+		PROFILE_SCOPE("FaceCuller::Cull")
+
+		const std::span<const u32> indices = model.GetUniqueVertexIndices();
+		const std::span<const Vec4f> positions = vertices.GetPositions();
+		const int faceCount = static_cast<int>(candidateFaces.size());
+		const Vec2f screenSize{ static_cast<float>(outputSize.x), static_cast<float>(outputSize.y) };
+
+		// keep the allocations from the previous frame around
+		for (int i = 0; i < 3; i++)
+		{
+			m_X[i].resize(faceCount);
+			m_Y[i].resize(faceCount);
+			m_W[i].resize(faceCount);
+		}
+		m_Visible.resize(faceCount);
+
+		const int batchCount = (faceCount + FACE_CULL_BATCH_SIZE - 1) / FACE_CULL_BATCH_SIZE;
+		GetThreadPool().ParallelFor(batchCount, [this, indices, positions, candidateFaces, faceCount, &screenSize](int batchIdx, int)
+		{
+			const int begin = batchIdx * FACE_CULL_BATCH_SIZE;
+			CullRange(indices, positions, candidateFaces, begin, std::min(begin + FACE_CULL_BATCH_SIZE, faceCount), screenSize);
+		});
+
+		m_VisibleFaces.clear();
+		for (int t = 0; t < faceCount; t++)
+		{
+			if (m_Visible[t])
+				m_VisibleFaces.push_back(candidateFaces[t]);
+		}
+	}
+
+	//--------------------------------------------------------------------------------------------------
+	void FaceCuller::CullRange(std::span<const u32> indices, std::span<const Vec4f> positions, std::span<const u32> candidateFaces,
+		int begin, int end, const Vec2f& screenSize)
+	{
+		// the vertices of the faces are gathered into the arrays first, the rest of the steps only read the arrays
+		for (int t = begin; t < end; t++)
+		{
+			const u32 faceIdx = candidateFaces[t];
+			for (int i = 0; i < 3; i++)
+			{
+				const Vec4f& position = positions[indices[faceIdx * 3 + i]];
+				m_X[i][t] = position.x();
+				m_Y[i][t] = position.y();
+				m_W[i][t] = position.w();
+			}
+		}
+
+		// Facing. The viewport keeps the orientation and the view space looks down +z, so faces that are
+		// counter-clockwise when looked at from the outside (as in the model files) end up with a negative determinant.
+		for (int t = begin; t < end; t++)
+		{
+			const float determinant = m_X[0][t] * (m_Y[1][t] * m_W[2][t] - m_Y[2][t] * m_W[1][t])
+				+ m_X[1][t] * (m_Y[2][t] * m_W[0][t] - m_Y[0][t] * m_W[2][t])
+				+ m_X[2][t] * (m_Y[0][t] * m_W[1][t] - m_Y[1][t] * m_W[0][t]);
+			m_Visible[t] = determinant < 0.f ? 1 : 0;
+		}
+
+		// outcodes, the same planes and distances ClipTriangle uses
+		for (int t = begin; t < end; t++)
+		{
+			u32 outsideOfAll = ~0u;
+			for (int i = 0; i < 3; i++)
+			{
+				const float x = m_X[i][t];
+				const float y = m_Y[i][t];
+				const float w = m_W[i][t];
+				outsideOfAll &= (w - NEAR_PLANE < 0.f ? 1u : 0u) | (FAR_PLANE - w < 0.f ? 2u : 0u)
+					| (x < 0.f ? 4u : 0u) | (screenSize.x * w - x < 0.f ? 8u : 0u)
+					| (y < 0.f ? 16u : 0u) | (screenSize.y * w - y < 0.f ? 32u : 0u);
+			}
+			m_Visible[t] &= outsideOfAll == 0 ? 1 : 0;
+		}
+	}
+}
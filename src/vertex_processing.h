@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <span>
+#include <vector>
+
+#include "geometry.h"
+#include "model.h"
+#include "shader.h"
+
+namespace sor
+{
+	// Multiplies count vectors given as separate arrays of their x, y, z and w by the matrix, 8 (AVX2) or 4 (SSE2) of
+	// them at a time up to MAX_VERTEX_SIMD_LEVEL. The result is the same as Mat4 * Vec4f gives, bit for bit, so a vertex
+	// doesn't move with the SIMD level. The output arrays can't overlap the input ones.
+	void TransformStreams(const Mat4& mat, const std::array<const float*, 4>& input, const std::array<float*, 4>& output,
+		int count);
+
+	//--------------------------------------------------------------------------------------------------
+	// Output of the vertex stage for a whole model. The vertex shader is run once for every unique vertex of the model
+	// instead of once for every face corner, most vertices are shared by about six faces. Primitive assembly then only
+	// fetches the transformed vertices of the face corners by their indices.
+	class TransformedVertexBuffer
+	{
+	public:
+		// Runs the vertex shader for all unique vertices of the model and transforms the positions by the viewport. The
+		// vertices are split into batches that are processed in parallel, each writes only its own part of the buffer.
+		// Without varying data only the positions are computed and the varying data of the buffer is left as it was.
+		void Transform(const Model& model, const IVertexShader& vertexShader, const Mat4& viewport, bool withVaryingData);
+
+		// position of the vertex after the viewport transformation, before the perspective division
+		const Vec4f& GetPosition(u32 uniqueVertexIdx) const { return m_Positions[uniqueVertexIdx]; }
+		std::span<const Vec4f> GetPositions() const { return m_Positions; }
+		const IShaderBase::VertexVaryingData& GetVaryingData(u32 uniqueVertexIdx) const { return m_VaryingData[uniqueVertexIdx]; }
+
+	private:
+		std::vector<Vec4f> m_Positions;
+		std::vector<IShaderBase::VertexVaryingData> m_VaryingData;
+	};
+
+	// how many faces one worker culls at a time
+	constexpr int FACE_CULL_BATCH_SIZE = 1024;
+
+	//--------------------------------------------------------------------------------------------------
+	// Drops the faces that can't be visible before any of them is assembled, only from their transformed vertices so it
+	// works the same under any model transformation. Faces are culled in batches in parallel, every step of a batch is a
+	// simple loop over structure of arrays so the compiler can vectorise it across faces.
+	//  - backfaces and faces with no area, by the sign of the determinant of the x, y and w of the vertices, that's the
+	//    doubled signed area in screen space scaled by the w of all three vertices so there's no division and it's right
+	//    even with vertices behind the camera
+	//  - faces with all vertices outside of the same frustum plane, by their outcodes
+	class FaceCuller
+	{
+	public:
+		// only candidateFaces are tested, the faces that are left of a coarser culling step
+		void Cull(const Model& model, const TransformedVertexBuffer& vertices, std::span<const u32> candidateFaces,
+			const Vec2i& outputSize);
+
+		// faces that can be visible, in the order of candidateFaces
+		std::span<const u32> GetVisibleFaces() const { return m_VisibleFaces; }
+
+	private:
+		void CullRange(std::span<const u32> indices, std::span<const Vec4f> positions, std::span<const u32> candidateFaces,
+			int begin, int end, const Vec2f& screenSize);
+
+		std::array<std::vector<float>, 3> m_X;
+		std::array<std::vector<float>, 3> m_Y;
+		std::array<std::vector<float>, 3> m_W;
+		std::vector<u8> m_Visible;
+		std::vector<u32> m_VisibleFaces;
+	};
+}
@@ -1,21 +1,74 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <limits>
+#include <type_traits>
 #include "geometry.h"
 #include "constants.h"
 
 namespace sor
 {
+	// size of the square tile the hierarchical z-buffer keeps the farthest depth for
+	constexpr int HI_Z_TILE_SIZE = 8;
+
+	// Depth interpolated for a pixel can be a bit closer than the exact one because of rounding, depth a triangle is
+	// tested against the hierarchical z-buffer with is moved closer by this fraction of its largest vertex depth.
+	constexpr float HI_Z_DEPTH_MARGIN = 1e-5f;
+
 	//-----------------------------------------------------------------------------------------------------------------
 	class ZBufferBase
 	{
 	public:
 		virtual bool TestAndWrite(int x, int y, float depth) = 0;
 		virtual bool Test(const Vec3i& vec) = 0;
+		// same test as TestAndWrite, without the write
+		virtual bool Test(int x, int y, float depth) const = 0;
+		virtual void Write(int x, int y, float depth) = 0;
+
+		// resets only the part that could have been written since the last clear
 		virtual void Clear() = 0;
 
+		// Direct access to the depth values for the SIMD rasterizer so it can test and write several of them at once,
+		// rows are GetWidth() values apart. nullptr if the buffer doesn't store the depth as floats.
+		virtual float* GetFloatData() { return nullptr; }
+		virtual int GetWidth() const = 0;
+
+		// Hierarchical z-buffer. Keeps conservative farthest depth of every HI_Z_TILE_SIZE tile, any fragment at least that
+		// far away in the tile is occluded. Tile coordinates are pixel coordinates divided by HI_Z_TILE_SIZE. Depth only
+		// gets closer with writes so the farthest depth stays conservative even if the tile isn't updated after a write.
+		virtual float GetFarthestDepth(int /*tileX*/, int /*tileY*/) const { return std::numeric_limits<float>::infinity(); }
+		// recomputes the farthest depth of the tile from its current depth values
+		virtual void UpdateFarthestDepth(int /*tileX*/, int /*tileY*/) {}
+		// true if every fragment in the area (inclusive, in pixels) is occluded if it's at least nearestDepth far away
+		virtual bool IsOccluded(const Vec2i& /*min*/, const Vec2i& /*max*/, float /*nearestDepth*/) const { return false; }
+
+		// How TestAndWrite() and Test() compare the depth, anyone testing through GetFloatData() has to follow it too.
+		// Clear() doesn't reset it.
+		void SetDepthCompare(EDepthCompare depthCompare) { m_DepthCompare = depthCompare; }
+		EDepthCompare GetDepthCompare() const { return m_DepthCompare; }
+
+		// Clear() only resets the area written since the last clear. Writes aren't tracked per pixel, whoever writes the
+		// depth has to mark the area (inclusive) once per primitive before, the rasterizers mark the bounding box.
+		void MarkWritten(const Vec2i& min, const Vec2i& max)
+		{
+			m_WrittenMin = { std::min(m_WrittenMin.x, min.x), std::min(m_WrittenMin.y, min.y) };
+			m_WrittenMax = { std::max(m_WrittenMax.x, max.x), std::max(m_WrittenMax.y, max.y) };
+		}
+
 		virtual ~ZBufferBase() = default;
+
+	protected:
+		bool HasWrittenArea() const { return m_WrittenMin.x <= m_WrittenMax.x && m_WrittenMin.y <= m_WrittenMax.y; }
+		void ResetWrittenArea()
+		{
+			m_WrittenMin = { std::numeric_limits<int>::max(), std::numeric_limits<int>::max() };
+			m_WrittenMax = { std::numeric_limits<int>::min(), std::numeric_limits<int>::min() };
+		}
+
+		Vec2i m_WrittenMin{ std::numeric_limits<int>::max(), std::numeric_limits<int>::max() };
+		Vec2i m_WrittenMax{ std::numeric_limits<int>::min(), std::numeric_limits<int>::min() };
+		EDepthCompare m_DepthCompare{ EDepthCompare::LESS };
 	};
 
 	//-----------------------------------------------------------------------------------------------------------------
@@ -24,7 +77,10 @@ namespace sor
 	public:
 		bool TestAndWrite(int x, int y, float depth) override { return true; }
 		bool Test(const Vec3i& vec) override { return true; }
+		bool Test(int x, int y, float depth) const override { return true; }
+		void Write(int x, int y, float depth) override {}
 		void Clear() override {}
+		int GetWidth() const override { return 0; }
 	};
 
 	//-----------------------------------------------------------------------------------------------------------------
@@ -37,33 +93,114 @@ namespace sor
 		{
 			for (T& val : m_Buffer)
 				val = invalid_value;
+			for (T& val : m_FarthestDepth)
+				val = invalid_value;
 		}
 
-		// tests the point against the zbuffer value and write if the z value is lower
+		// tests the point against the zbuffer value and writes it if it passes the depth compare function
 		bool TestAndWrite(int x, int y, float depth) override;
 
-		// tests the point agains the z buffer and returns whether the z value is lower (true) or not (false)
+		// tests the point against the z buffer with the depth compare function, without writing it
 		bool Test(const Vec3i& vec) override;
 
+		bool Test(int x, int y, float depth) const override
+		{
+			return PassesDepthTest(m_DepthCompare, depth, static_cast<float>(m_Buffer[y * width + x]));
+		}
+
+		void Write(int x, int y, float depth) override
+		{
+			m_Buffer[y * width + x] = depth;
+		}
+
 		void Clear() override
 		{
-			for (T& val : m_Buffer)
-				val = invalid_value;
+			if (!HasWrittenArea())
+				return;
+
+			const int minX = std::max(m_WrittenMin.x, 0);
+			const int maxX = std::min(m_WrittenMax.x, width - 1);
+			const int minY = std::max(m_WrittenMin.y, 0);
+			const int maxY = std::min(m_WrittenMax.y, height - 1);
+			ResetWrittenArea();
+			if (minX > maxX || minY > maxY)
+				return;
+
+			for (int y = minY; y <= maxY; y++)
+				std::fill(m_Buffer.begin() + y * width + minX, m_Buffer.begin() + y * width + maxX + 1, invalid_value);
+
+			for (int tileY = minY / HI_Z_TILE_SIZE; tileY <= maxY / HI_Z_TILE_SIZE; tileY++)
+			{
+				std::fill(m_FarthestDepth.begin() + tileY * hiZWidth + minX / HI_Z_TILE_SIZE,
+					m_FarthestDepth.begin() + tileY * hiZWidth + maxX / HI_Z_TILE_SIZE + 1, invalid_value);
+			}
+		}
+
+		float* GetFloatData() override
+		{
+			if constexpr (std::is_same_v<T, float>)
+				return m_Buffer.data();
+			else
+				return nullptr;
+		}
+
+		int GetWidth() const override { return width; }
+
+		float GetFarthestDepth(int tileX, int tileY) const override
+		{
+			return static_cast<float>(m_FarthestDepth[tileY * hiZWidth + tileX]);
+		}
+
+		void UpdateFarthestDepth(int tileX, int tileY) override;
+
+		bool IsOccluded(const Vec2i& min, const Vec2i& max, float nearestDepth) const override
+		{
+			for (int tileY = min.y / HI_Z_TILE_SIZE; tileY <= max.y / HI_Z_TILE_SIZE; tileY++)
+			{
+				for (int tileX = min.x / HI_Z_TILE_SIZE; tileX <= max.x / HI_Z_TILE_SIZE; tileX++)
+				{
+					if (!(nearestDepth >= m_FarthestDepth[tileY * hiZWidth + tileX]))
+						return false;
+				}
+			}
+
+			return true;
 		}
 
 	private:
+		static constexpr int hiZWidth = (width + HI_Z_TILE_SIZE - 1) / HI_Z_TILE_SIZE;
+		static constexpr int hiZHeight = (height + HI_Z_TILE_SIZE - 1) / HI_Z_TILE_SIZE;
+
 		std::array<T, width * height> m_Buffer;
+		std::array<T, hiZWidth * hiZHeight> m_FarthestDepth;
 	};
 
+	template <typename T, int width, int height, T invalid_value >
+	void ZBuffer<T, width, height, invalid_value>::UpdateFarthestDepth(int tileX, int tileY)
+	{
+		const int minX = tileX * HI_Z_TILE_SIZE;
+		const int minY = tileY * HI_Z_TILE_SIZE;
+		const int maxX = std::min(minX + HI_Z_TILE_SIZE, width);
+		const int maxY = std::min(minY + HI_Z_TILE_SIZE, height);
+
+		T farthest = m_Buffer[minY * width + minX];
+		for (int y = minY; y < maxY; y++)
+		{
+			for (int x = minX; x < maxX; x++)
+				farthest = std::max(farthest, m_Buffer[y * width + x]);
+		}
+
+		m_FarthestDepth[tileY * hiZWidth + tileX] = farthest;
+	}
+
 	template <typename T, int width, int height, T invalid_value >
 	bool ZBuffer<T, width, height, invalid_value>::TestAndWrite(int x, int y, float depth)
 	{
-		int index = y * (width - 1) + x;
+		int index = y * width + x;
 		T val = m_Buffer[index];
-		const bool testResult = (depth <= val);
-		//printf("Testing at (%d, %d, %d): %s, stored: %d \n", vec.x, vec.y, vec.z, testResult ? "false" : "true", m_Buffer[index]);
-
-		if (testResult)
+		// depth grows with the distance from the camera so with the LESS compare the fragment is occluded if it isn't
+		// closer than what's stored
+		if (!PassesDepthTest(m_DepthCompare, depth, static_cast<float>(val)))
 			return false;
 
 		m_Buffer[index] = depth;
@@ -74,15 +211,14 @@ namespace sor
 	template <typename T, int width, int height, T invalid_value >
 	bool ZBuffer<T, width, height, invalid_value >::Test(const Vec3i& vec)
 	{
-		T val = m_Buffer[vec.y * width + vec.x];
-		return vec.z > val;
+		return Test(vec.x, vec.y, static_cast<float>(vec.z));
 	}
 
 	//using ZBufferIntDefault = ZBuffer<int, IMAGE_SIZE_DEFAULT_X, IMAGE_SIZE_DEFAULT_Y, std::numeric_limits<int>::min()>;
 		//typedef ZBuffer<int, IMAGE_SIZE_DEFAULT_X, IMAGE_SIZE_DEFAULT_Y, std::numeric_limits<int>::min()> ZBufferIntDefault;
 
 	// for some reason it has problems with the construct with std::numeric_limits -- uncomment the code to see it
-	class ZBufferFloatDefault : public ZBuffer<float, IMAGE_SIZE_DEFAULT_X, IMAGE_SIZE_DEFAULT_Y, -1000.f>
+	class ZBufferFloatDefault : public ZBuffer<float, IMAGE_SIZE_DEFAULT_X, IMAGE_SIZE_DEFAULT_Y, 1000.f>
 	{
 		
 	};